@@ -0,0 +1,274 @@
+#include "catalog.h"
+#include <algorithm>
+#include <time.h>
+#include "core.h"
+
+// System times before this mean the clock was not set yet
+#define GPT_CATALOG_TIME_VALID 1700000000
+
+GPTModelCatalog::GPTModelCatalog()
+	: _fs(nullptr)
+	, _ttl(GPT_CATALOG_TTL_S)
+	, _loaded(false)
+	, _fetchedAt(0)
+	, _lock(xSemaphoreCreateMutex())
+{
+}
+
+GPTModelCatalog::~GPTModelCatalog() {
+	vSemaphoreDelete(_lock);
+}
+
+bool GPTModelCatalog::begin(fs::FS& fs, const char* path, uint32_t ttlSeconds) {
+	_fs = &fs;
+	_path = path;
+	_ttl = ttlSeconds;
+
+	std::vector<Model> models;
+	time_t fetchedAt = 0;
+	if (!load(models, fetchedAt)) {
+		return false;
+	}
+	GPT_LOGI(CATALOG, "Loaded %u cached models", models.size());
+	replace(models, fetchedAt);
+	return true;
+}
+
+bool GPTModelCatalog::refresh(const String& apiKey, bool force) {
+	time_t now = time(nullptr);
+	bool timeKnown = now > GPT_CATALOG_TIME_VALID;
+
+	// Without a clock the age of a loaded catalog is unknown, keep it
+	bool stale = !_loaded || (timeKnown && (_fetchedAt == 0 || now - _fetchedAt >= (time_t) _ttl));
+	if (!force && !stale) {
+		return true;
+	}
+
+	std::vector<Model> models;
+	if (!fetch(apiKey, models)) {
+		return _loaded;
+	}
+
+	time_t fetchedAt = timeKnown ? now : 0;
+	if (_fs != nullptr) {
+		save(models, fetchedAt);
+	}
+	GPT_LOGI(CATALOG, "Fetched %u models", models.size());
+	replace(models, fetchedAt);
+	return true;
+}
+
+bool GPTModelCatalog::contains(const char* id) const {
+	if (!_loaded) {
+		return true;
+	}
+
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	bool found = find(id) != nullptr;
+	xSemaphoreGive(_lock);
+	return found;
+}
+
+const GPTModelCatalog::Model* GPTModelCatalog::find(const char* id) const {
+	for (const Model& model : _models) {
+		if (strcmp(model.id, id) == 0) {
+			return &model;
+		}
+	}
+	return nullptr;
+}
+
+const char* GPTModelCatalog::intern(const String& name) {
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	const char* interned = nullptr;
+	for (const String& known : _names) {
+		if (known == name) {
+			interned = known.c_str();
+			break;
+		}
+	}
+	if (interned == nullptr) {
+		// deque elements stay in place when others are appended
+		_names.push_back(name);
+		interned = _names.back().c_str();
+	}
+	xSemaphoreGive(_lock);
+	return interned;
+}
+
+bool GPTModelCatalog::classify(const String& id, Category& category) {
+	// Dated snapshots duplicate their alias, e.g. gpt-4o-2024-08-06
+	int length = id.length();
+	if (length > 11 && id[length - 11] == '-' && id[length - 6] == '-' && id[length - 3] == '-'
+		&& isdigit(id[length - 10]) && isdigit(id[length - 1])) {
+		return false;
+	}
+
+	if (id.indexOf("realtime") >= 0) {
+		category = GPT_CATALOG_REALTIME;
+		return true;
+	}
+	if (id.indexOf("transcribe") >= 0 || id.startsWith("whisper")) {
+		category = GPT_CATALOG_TRANSCRIPTION;
+		return true;
+	}
+	if (id.indexOf("audio") >= 0) {
+		category = GPT_CATALOG_AUDIO;
+		return true;
+	}
+
+	// Models of endpoints no service talks to
+	static const char* const OTHER[] = {
+		"tts", "image", "embedding", "moderation", "dall-e", "search",
+		"instruct", "codex", "computer-use", "deep-research", "sora"
+	};
+	for (const char* other : OTHER) {
+		if (id.indexOf(other) >= 0) {
+			return false;
+		}
+	}
+
+	if (id.startsWith("gpt-") || (id.length() > 1 && id[0] == 'o' && isdigit(id[1]))) {
+		category = GPT_CATALOG_TEXT;
+		return true;
+	}
+	return false;
+}
+
+String GPTModelCatalog::displayName(const String& id) {
+	String name;
+	name.reserve(id.length() + 2);
+
+	int start = 0;
+	bool first = true;
+	while (start <= (int) id.length()) {
+		int end = id.indexOf('-', start);
+		if (end < 0) {
+			end = id.length();
+		}
+		String part = id.substring(start, end);
+		start = end + 1;
+		if (part.isEmpty()) {
+			continue;
+		}
+
+		if (first) {
+			part.toUpperCase();
+			name = part;
+			first = false;
+			continue;
+		}
+
+		// Versions stay attached to the family: GPT-4.1, GPT-5
+		name += name == "GPT" && isdigit(part[0]) ? '-' : ' ';
+		part.setCharAt(0, toupper(part[0]));
+		name += part;
+	}
+	return name;
+}
+
+bool GPTModelCatalog::fetch(const String& apiKey, std::vector<Model>& models) {
+	gptHttp->acquire(); // wait for the request of another service to finish
+	gptWifiClient->setInsecure(); // For HTTPS without certificate validation
+	gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/models");
+	gptHttp->setReuse(true); // the reply is read by length, keep the TLS session
+	gptHttp->addAuthorization(apiKey); // next key of gptKeys, if any
+	gptHttp->setTimeout(30000); // 30 second timeout
+	gptHttp->setTransportProfile(GPTTransportProfile::GPT_BULK); // large reply, not latency bound
+	gptHttp->setAcceptEncoding(true); // the list compresses well
+
+	// Only the IDs are kept from the list, parsed as it arrives
+	JsonDocument filter;
+	filter["data"][0]["id"] = true;
+
+	GPTArenaAllocator arena;
+	JsonDocument doc(&arena);
+	DeserializationError error;
+	int httpCode = gptHttp->GET();
+	if (httpCode == 200) {
+		error = gptHttp->deserializeBody(doc, filter);
+	}
+	gptHttp->end();
+	gptHttp->release();
+
+	if (httpCode != 200) {
+		GPT_LOGE(CATALOG, "Model list request failed, code: %d", httpCode);
+		return false;
+	}
+	if (error) {
+		GPT_LOGE(CATALOG, "JSON parse error: %s", error.c_str());
+		return false;
+	}
+
+	for (JsonObjectConst item : doc["data"].as<JsonArrayConst>()) {
+		String id = item["id"] | "";
+		Category category;
+		if (classify(id, category)) {
+			models.push_back({category, intern(id), intern(displayName(id))});
+		}
+	}
+
+	std::sort(models.begin(), models.end(), [](const Model& a, const Model& b) {
+		return strcmp(a.id, b.id) < 0;
+	});
+	return !models.empty();
+}
+
+bool GPTModelCatalog::load(std::vector<Model>& models, time_t& fetchedAt) {
+	if (_fs == nullptr || !_fs->exists(_path)) {
+		return false;
+	}
+	File file = _fs->open(_path, "r");
+	if (!file) {
+		return false;
+	}
+
+	// Fetch time, then one "<category> <id>" line per model
+	fetchedAt = (time_t) file.readStringUntil('\n').toInt();
+	while (file.available()) {
+		String line = file.readStringUntil('\n');
+		if (line.length() < 3 || line[1] != ' ' || line[0] < '0' || line[0] > '0' + GPT_CATALOG_REALTIME) {
+			continue;
+		}
+		String id = line.substring(2);
+		models.push_back({(Category) (line[0] - '0'), intern(id), intern(displayName(id))});
+	}
+	file.close();
+	return !models.empty();
+}
+
+bool GPTModelCatalog::save(const std::vector<Model>& models, time_t fetchedAt) {
+	GPTString content;
+	content.append(String((long) fetchedAt));
+	content.append('\n');
+	for (const Model& model : models) {
+		content.append((char) ('0' + model.category));
+		content.append(' ');
+		content += model.id;
+		content.append('\n');
+	}
+
+	// Write a temporary file and swap it in, a power loss keeps the old catalog
+	String tempPath = _path + ".tmp";
+	File file = _fs->open(tempPath, "w");
+	bool ok = file && file.write((const uint8_t*) content.c_str(), content.length()) == content.length();
+	if (file) {
+		file.close();
+	}
+	if (ok) {
+		_fs->remove(_path);
+		ok = _fs->rename(tempPath, _path);
+	}
+	if (!ok) {
+		GPT_LOGE(CATALOG, "Failed to write catalog file %s", _path.c_str());
+	}
+	return ok;
+}
+
+void GPTModelCatalog::replace(std::vector<Model>& models, time_t fetchedAt) {
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	_models.swap(models);
+	_fetchedAt = fetchedAt;
+	_loaded = true;
+	xSemaphoreGive(_lock);
+}
@@ -0,0 +1,144 @@
+#ifndef GPT_CATALOG_H
+#define GPT_CATALOG_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "lazy.h"
+
+// Age after which the cached catalog is fetched again
+#ifndef GPT_CATALOG_TTL_S
+#define GPT_CATALOG_TTL_S (7 * 24 * 60 * 60)
+#endif
+
+/**
+ * Models available to the API key, fetched from /v1/models and cached in
+ * a file. The getAvailableModels() functions of the services list the
+ * catalog entries of their kind when it is loaded, and fall back to their
+ * built-in lists otherwise. Built-in models keep their order and names;
+ * models only known to the catalog follow with generated names.
+ */
+class GPTModelCatalog {
+public:
+	enum Category : uint8_t {
+		GPT_CATALOG_TEXT,          // GPTService
+		GPT_CATALOG_AUDIO,         // GPTService audio prompts
+		GPT_CATALOG_TRANSCRIPTION, // GPTSttService
+		GPT_CATALOG_REALTIME       // GPTStsService
+	};
+
+	GPTModelCatalog();
+	~GPTModelCatalog();
+
+	/**
+	 * Load the cached catalog
+	 * @param fs Filesystem holding the cache file
+	 * @param path Path of the cache file
+	 * @param ttlSeconds Age after which refresh() fetches the catalog again
+	 * @return true if a cached catalog was loaded
+	 */
+	bool begin(fs::FS& fs, const char* path = "/gpt_models.txt", uint32_t ttlSeconds = GPT_CATALOG_TTL_S);
+
+	/**
+	 * Fetch the catalog if the cached one is missing or older than the TTL.
+	 * Blocks for one request; the age is only known once the system time
+	 * was set, e.g. by configTime().
+	 * @param apiKey OpenAI API key
+	 * @param force Fetch even if the cached catalog is recent
+	 * @return true if a catalog is loaded afterwards
+	 */
+	bool refresh(const String& apiKey, bool force = false);
+
+	/**
+	 * Check if a fetched or cached catalog is loaded
+	 */
+	bool isLoaded() const { return _loaded; }
+
+	/**
+	 * Check if a model is in the catalog, true while none is loaded
+	 * @param id Model ID
+	 */
+	bool contains(const char* id) const;
+
+	/**
+	 * List the models of a category, see the class comment. Names point into
+	 * the catalog and stay valid for its lifetime, also across refresh().
+	 * @param category Model kind
+	 * @param builtin Built-in list, cheapest first
+	 * @param count Entries in the built-in list
+	 * @return Models, the built-in list while no catalog is loaded
+	 */
+	template <typename T>
+	std::vector<T> getModels(Category category, const T* builtin, size_t count) const {
+		if (!_loaded) {
+			return std::vector<T>(builtin, builtin + count);
+		}
+
+		std::vector<T> models;
+		xSemaphoreTake(_lock, portMAX_DELAY);
+		for (size_t i = 0; i < count; i++) {
+			const Model* model = find(builtin[i].id);
+			if (model != nullptr && model->category == category) {
+				models.push_back(builtin[i]);
+			}
+		}
+		for (const Model& model : _models) {
+			if (model.category == category && !isBuiltin(model.id, builtin, count)) {
+				models.push_back(T{model.id, model.displayName});
+			}
+		}
+		xSemaphoreGive(_lock);
+		return models;
+	}
+
+private:
+	struct Model {
+		Category category;
+		const char* id;          // interned, see intern()
+		const char* displayName; // interned
+	};
+
+	// Callers hold _lock
+	const Model* find(const char* id) const;
+
+	template <typename T>
+	static bool isBuiltin(const char* id, const T* builtin, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			if (strcmp(builtin[i].id, id) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Kind of a model ID, false for models no service uses
+	static bool classify(const String& id, Category& category);
+
+	// "gpt-4.1-mini" -> "GPT-4.1 Mini"
+	static String displayName(const String& id);
+
+	// Stable copy of a name; takes _lock
+	const char* intern(const String& name);
+
+	bool fetch(const String& apiKey, std::vector<Model>& models);
+	bool load(std::vector<Model>& models, time_t& fetchedAt);
+	bool save(const std::vector<Model>& models, time_t fetchedAt);
+	void replace(std::vector<Model>& models, time_t fetchedAt);
+
+	fs::FS* _fs;
+	String _path;
+	uint32_t _ttl;
+	std::atomic<bool> _loaded;
+	time_t _fetchedAt; // 0 while unknown
+	std::vector<Model> _models;
+	// Names handed out by getModels() must outlive a refresh, so none is
+	// ever freed; the pool only grows when the API lists a new model
+	std::deque<String> _names;
+	SemaphoreHandle_t _lock;
+};
+
+extern GPTLazy<GPTModelCatalog> gptCatalog;
+
+#endif // GPT_CATALOG_H
@@ -0,0 +1,34 @@
+#ifndef GPT_CONFIG_H
+#define GPT_CONFIG_H
+
+// Services built into the library. Arduino compiles every source file of a
+// library whatever the sketch includes, so a service is only left out of
+// the firmware when its switch is set to 0 through build flags, e.g.
+// PlatformIO build_flags = -DGPT_ENABLE_STS=0
+#ifndef GPT_ENABLE_GPT
+#define GPT_ENABLE_GPT 1
+#endif
+
+#ifndef GPT_ENABLE_TTS
+#define GPT_ENABLE_TTS 1
+#endif
+
+#ifndef GPT_ENABLE_STT
+#define GPT_ENABLE_STT 1
+#endif
+
+#ifndef GPT_ENABLE_STS
+#define GPT_ENABLE_STS 1
+#endif
+
+// WebSocket transport, only the realtime session uses it. Without it the
+// arduinoWebSockets library is not needed.
+#ifndef GPT_ENABLE_WEBSOCKET
+#define GPT_ENABLE_WEBSOCKET GPT_ENABLE_STS
+#endif
+
+#if GPT_ENABLE_STS && !GPT_ENABLE_WEBSOCKET
+#error "GPT_ENABLE_STS needs GPT_ENABLE_WEBSOCKET"
+#endif
+
+#endif // GPT_CONFIG_H
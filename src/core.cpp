@@ -1,5 +1,12 @@
 #include "core.h"
 
-GPTWifiClient *gptWifiClient = new GPTWifiClient;
-GPTClient *gptHttp = new GPTClient;
-WebSocketsClient *gptWebSocket = new WebSocketsClient;
\ No newline at end of file
+// Created on first use, see GPTLazy
+GPTLazy<GPTDnsCache> gptDns;
+GPTLazy<GPTModelCatalog> gptCatalog;
+GPTLazy<GPTKeyPool> gptKeys;
+
+GPTLazy<GPTWifiClient> gptWifiClient;
+GPTLazy<GPTClient> gptHttp;
+#if GPT_ENABLE_WEBSOCKET
+GPTLazy<WebSocketsClient> gptWebSocket;
+#endif
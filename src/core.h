@@ -1,8 +1,33 @@
 #pragma once
+#include "config.h"
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <WiFiClientSecure.h>
+#if GPT_ENABLE_WEBSOCKET
 #include <WebSocketsClient.h>
+#endif
+#include <StreamString.h>
+#include <lwip/sockets.h>
+#include <atomic>
+#include <string_view>
+#include <vector>
+#include "resolver.h"
+#include "catalog.h"
+#include "keypool.h"
+#include "log.h"
+
+// Response decompression uses the inflater of the ROM miniz
+#ifndef GPT_HTTP_DECOMPRESSION
+#if __has_include("rom/miniz.h")
+#define GPT_HTTP_DECOMPRESSION 1
+#else
+#define GPT_HTTP_DECOMPRESSION 0
+#endif
+#endif
+
+#if GPT_HTTP_DECOMPRESSION
+#include "rom/miniz.h"
+#endif
 
 // Enum for audio formats
 enum class GPTAudioFormat {
@@ -80,10 +105,716 @@ public:
   }
 };
 
+/**
+ * Growable text / byte buffer for library-internal payloads. Memory comes
+ * from a pluggable allocator (PSRAM by default) instead of the internal
+ * heap used by String. Doubles as a Stream so serializers and HTTP
+ * readers can write into it and request bodies can be read back from it.
+ */
+class GPTString : public Stream {
+public:
+  explicit GPTString(ArduinoJson::Allocator* allocator = GPTSpiAllocator::instance())
+    : _allocator(allocator), _data(nullptr), _length(0), _capacity(0), _readPos(0) {}
+
+  GPTString(std::string_view str, ArduinoJson::Allocator* allocator = GPTSpiAllocator::instance())
+    : GPTString(allocator) {
+    append(str);
+  }
+
+  GPTString(GPTString&& other) noexcept
+    : _allocator(other._allocator), _data(other._data), _length(other._length),
+      _capacity(other._capacity), _readPos(other._readPos) {
+    other._data = nullptr;
+    other._length = 0;
+    other._capacity = 0;
+    other._readPos = 0;
+  }
+
+  GPTString& operator=(GPTString&& other) noexcept {
+    if (this != &other) {
+      release();
+      _allocator = other._allocator;
+      _data = other._data;
+      _length = other._length;
+      _capacity = other._capacity;
+      _readPos = other._readPos;
+      other._data = nullptr;
+      other._length = 0;
+      other._capacity = 0;
+      other._readPos = 0;
+    }
+    return *this;
+  }
+
+  GPTString(const GPTString&) = delete;
+  GPTString& operator=(const GPTString&) = delete;
+
+  ~GPTString() {
+    release();
+  }
+
+  /**
+   * @brief Make sure capacity bytes fit without reallocation
+   * @param capacity Number of bytes, excluding the terminator
+   * @return true if the memory is available
+   */
+  bool reserve(size_t capacity) {
+    if (capacity <= _capacity) {
+      return true;
+    }
+
+    char* data = (char*) _allocator->reallocate(_data, capacity + 1);
+    if (!data) {
+      return false;
+    }
+    _data = data;
+    _capacity = capacity;
+    _data[_length] = '\0';
+    return true;
+  }
+
+  /**
+   * @brief Append bytes, growing the buffer geometrically
+   * @param data Bytes to append
+   * @param length Number of bytes
+   * @return true if appended
+   */
+  bool append(const char* data, size_t length) {
+    if (length == 0) {
+      return true;
+    }
+    if (_length + length > _capacity && !reserve(grow(_length + length))) {
+      return false;
+    }
+    memcpy(_data + _length, data, length);
+    _length += length;
+    _data[_length] = '\0';
+    return true;
+  }
+
+  bool append(std::string_view str) { return append(str.data(), str.size()); }
+  bool append(const String& str) { return append(str.c_str(), str.length()); }
+  bool append(char c) { return append(&c, 1); }
+
+  GPTString& operator+=(std::string_view str) { append(str); return *this; }
+  GPTString& operator+=(const String& str) { append(str); return *this; }
+  GPTString& operator+=(const char* str) { append(std::string_view(str)); return *this; }
+  GPTString& operator+=(char c) { append(c); return *this; }
+
+  /**
+   * @brief Drop the content but keep the memory
+   */
+  void clear() {
+    _length = 0;
+    _readPos = 0;
+    if (_data) {
+      _data[0] = '\0';
+    }
+  }
+
+  const char* c_str() const { return _data ? _data : ""; }
+  char* data() { return _data; }
+  size_t length() const { return _length; }
+  size_t capacity() const { return _capacity; }
+  bool isEmpty() const { return _length == 0; }
+
+  std::string_view view() const { return std::string_view(c_str(), _length); }
+  operator std::string_view() const { return view(); }
+
+  /**
+   * @brief Copy into an Arduino String for public API boundaries
+   */
+  String toString() const { return String(c_str(), _length); }
+
+  // Print
+  using Print::write;
+
+  size_t write(uint8_t c) override {
+    return append((char) c) ? 1 : 0;
+  }
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    return append((const char*) buffer, size) ? size : 0;
+  }
+
+  // Stream, reads back what was written
+  int available() override {
+    return _length - _readPos;
+  }
+
+  int read() override {
+    return _readPos < _length ? (uint8_t) _data[_readPos++] : -1;
+  }
+
+  int peek() override {
+    return _readPos < _length ? (uint8_t) _data[_readPos] : -1;
+  }
+
+  using Stream::readBytes;
+
+  size_t readBytes(char* buffer, size_t length) override {
+    size_t count = _length - _readPos;
+    if (count > length) {
+      count = length;
+    }
+    memcpy(buffer, _data + _readPos, count);
+    _readPos += count;
+    return count;
+  }
+
+  void flush() override {}
+
+private:
+  static size_t grow(size_t needed) {
+    size_t capacity = 32;
+    while (capacity < needed) {
+      capacity += capacity / 2;
+    }
+    return capacity;
+  }
+
+  void release() {
+    if (_data) {
+      _allocator->deallocate(_data);
+    }
+    _data = nullptr;
+    _length = 0;
+    _capacity = 0;
+    _readPos = 0;
+  }
+
+  ArduinoJson::Allocator* _allocator;
+  char* _data;
+  size_t _length;
+  size_t _capacity;
+  size_t _readPos;
+};
+
+/**
+ * Text argument of the public entry points. Literals, views and String
+ * lvalues are borrowed, String rvalues are taken over, so the text is
+ * copied at most once on its way into a request.
+ */
+class GPTText {
+public:
+  GPTText(const char* str) : _view(str ? str : ""), _owning(false) {}
+  GPTText(const __FlashStringHelper* str) : GPTText(reinterpret_cast<const char*>(str)) {}
+  GPTText(std::string_view str) : _view(str), _owning(false) {}
+  GPTText(const String& str) : _view(str.c_str(), str.length()), _owning(false) {}
+  GPTText(String&& str) : _owned(std::move(str)), _owning(true) {}
+
+  /**
+   * View of the text, valid while this object and the borrowed source live
+   */
+  std::string_view view() const {
+    return _owning ? std::string_view(_owned.c_str(), _owned.length()) : _view;
+  }
+
+  size_t length() const { return view().size(); }
+  bool isEmpty() const { return length() == 0; }
+
+  /**
+   * Hand the text over as a String, moving it out when owned
+   * (copies borrowed text once). Leaves this object empty.
+   */
+  String release() {
+    if (_owning) {
+      _owning = false;
+      return std::move(_owned);
+    }
+    std::string_view view = _view;
+    _view = std::string_view();
+    return String(view.data(), view.size());
+  }
+
+private:
+  std::string_view _view;
+  String _owned;
+  bool _owning;
+};
+
+/**
+ * Streaming base64 encoder writing to any Print. Input may be fed in
+ * arbitrary pieces, at most two bytes are carried between calls.
+ */
+class GPTBase64Encoder {
+public:
+  explicit GPTBase64Encoder(Print& out) : _out(out), _carry{0, 0}, _carryLength(0), _written(0) {}
+
+  /**
+   * @brief Encoded size of length input bytes, including padding
+   */
+  static size_t encodedLength(size_t length) {
+    return ((length + 2) / 3) * 4;
+  }
+
+  /**
+   * @brief Encode a piece of input
+   * @param data Input bytes
+   * @param length Number of bytes
+   * @return Number of characters written
+   */
+  size_t write(const uint8_t* data, size_t length) {
+    char chunk[64];
+    size_t chunkLength = 0;
+    size_t before = _written;
+
+    // complete a group started by the previous call
+    if (_carryLength > 0) {
+      while (_carryLength < 2 && length > 0) {
+        _carry[_carryLength++] = *data++;
+        length--;
+      }
+      if (_carryLength == 2 && length > 0) {
+        encodeGroup(_carry[0], _carry[1], *data++, chunk);
+        length--;
+        chunkLength = 4;
+        _carryLength = 0;
+      }
+    }
+
+    while (length >= 3) {
+      encodeGroup(data[0], data[1], data[2], chunk + chunkLength);
+      chunkLength += 4;
+      data += 3;
+      length -= 3;
+      if (chunkLength == sizeof(chunk)) {
+        _written += _out.write((const uint8_t*) chunk, chunkLength);
+        chunkLength = 0;
+      }
+    }
+
+    for (size_t i = 0; i < length; i++) {
+      _carry[_carryLength++] = data[i];
+    }
+
+    if (chunkLength > 0) {
+      _written += _out.write((const uint8_t*) chunk, chunkLength);
+    }
+    return _written - before;
+  }
+
+  /**
+   * @brief Flush carried bytes with padding
+   * @return Total number of characters written
+   */
+  size_t finish() {
+    if (_carryLength > 0) {
+      char quad[4];
+      encodeGroup(_carry[0], _carryLength > 1 ? _carry[1] : 0, 0, quad);
+      quad[3] = '=';
+      if (_carryLength == 1) {
+        quad[2] = '=';
+      }
+      _written += _out.write((const uint8_t*) quad, 4);
+      _carryLength = 0;
+    }
+    return _written;
+  }
+
+private:
+  static void encodeGroup(uint8_t a, uint8_t b, uint8_t c, char* out) {
+    static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t n = ((uint32_t) a << 16) | ((uint32_t) b << 8) | c;
+    out[0] = base64Chars[(n >> 18) & 0x3F];
+    out[1] = base64Chars[(n >> 12) & 0x3F];
+    out[2] = base64Chars[(n >> 6) & 0x3F];
+    out[3] = base64Chars[n & 0x3F];
+  }
+
+  Print& _out;
+  uint8_t _carry[2];
+  uint8_t _carryLength;
+  size_t _written;
+};
+
+// Default slab size of GPTArenaAllocator
+#ifndef GPT_ARENA_SLAB_SIZE
+#define GPT_ARENA_SLAB_SIZE (8 * 1024)
+#endif
+
+// Upper bound the slab may grow to after overflowing
+#ifndef GPT_ARENA_MAX_SLAB_SIZE
+#define GPT_ARENA_MAX_SLAB_SIZE (128 * 1024)
+#endif
+
+/**
+ * Bump allocator for ArduinoJson documents and scratch buffers.
+ * Allocations are carved from one reusable PSRAM slab and released
+ * together by reset(). Requests that do not fit go to overflow blocks,
+ * and the slab grows to the observed peak on the next reset so steady
+ * state traffic is served from a single slab.
+ */
+class GPTArenaAllocator : public ArduinoJson::Allocator {
+public:
+  explicit GPTArenaAllocator(size_t slabSize = GPT_ARENA_SLAB_SIZE,
+                             ArduinoJson::Allocator* upstream = GPTSpiAllocator::instance())
+    : _upstream(upstream), _slab(nullptr), _capacity(align(slabSize)), _used(0), _last(SIZE_MAX),
+      _overflow(nullptr), _overflowBytes(0), _peak(0), _overflowCount(0) {}
+
+  ~GPTArenaAllocator() {
+    releaseOverflow();
+    if (_slab) {
+      _upstream->deallocate(_slab);
+    }
+  }
+
+  GPTArenaAllocator(const GPTArenaAllocator&) = delete;
+  GPTArenaAllocator& operator=(const GPTArenaAllocator&) = delete;
+
+  /**
+   * @brief Allocate from the slab, or from an overflow block when full
+   * @param size Size of memory to allocate
+   * @return Pointer to allocated memory
+   */
+  void* allocate(size_t size) override {
+    size_t need = sizeof(Block) + align(size);
+    if (!_slab && _capacity > 0) {
+      _slab = (uint8_t*) _upstream->allocate(_capacity);
+    }
+
+    if (_slab && _used + need <= _capacity) {
+      Block* block = (Block*) (_slab + _used);
+      block->size = align(size);
+      block->next = nullptr;
+      _last = _used;
+      _used += need;
+      track();
+      return block + 1;
+    }
+
+    Block* block = (Block*) _upstream->allocate(need);
+    if (!block) {
+      return nullptr;
+    }
+    block->size = align(size);
+    block->next = _overflow;
+    _overflow = block;
+    _overflowBytes += need;
+    _overflowCount++;
+    track();
+    return block + 1;
+  }
+
+  /**
+   * @brief Release a block. Slab memory is only reclaimed for the most
+   * recent allocation, everything else waits for reset()
+   * @param pointer Pointer to memory to free
+   */
+  void deallocate(void* pointer) override {
+    if (!pointer) {
+      return;
+    }
+
+    Block* block = (Block*) pointer - 1;
+    if (owns(pointer)) {
+      if ((uint8_t*) block - _slab == (ptrdiff_t) _last) {
+        _used = _last;
+        _last = SIZE_MAX;
+      }
+      return;
+    }
+
+    for (Block** link = &_overflow; *link; link = &(*link)->next) {
+      if (*link == block) {
+        *link = block->next;
+        _overflowBytes -= sizeof(Block) + block->size;
+        _upstream->deallocate(block);
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Resize a block, in place when it is the most recent allocation
+   * @param ptr Pointer to memory to reallocate
+   * @param new_size New size for memory block
+   * @return Pointer to reallocated memory
+   */
+  void* reallocate(void* ptr, size_t new_size) override {
+    if (!ptr) {
+      return allocate(new_size);
+    }
+
+    Block* block = (Block*) ptr - 1;
+    if (owns(ptr) && (uint8_t*) block - _slab == (ptrdiff_t) _last
+        && _last + sizeof(Block) + align(new_size) <= _capacity) {
+      block->size = align(new_size);
+      _used = _last + sizeof(Block) + block->size;
+      track();
+      return ptr;
+    }
+
+    if (new_size <= block->size) {
+      return ptr;
+    }
+
+    void* moved = allocate(new_size);
+    if (moved) {
+      memcpy(moved, ptr, block->size);
+      deallocate(ptr);
+    }
+    return moved;
+  }
+
+  /**
+   * @brief Allocate the slab up front so the first use does not hit the heap
+   * @return true if the slab is available
+   */
+  bool reserve() {
+    if (!_slab && _capacity > 0) {
+      _slab = (uint8_t*) _upstream->allocate(_capacity);
+    }
+    return _slab != nullptr;
+  }
+
+  /**
+   * @brief Release every allocation at once. Documents using the arena
+   * must be cleared first. The slab is kept, and regrown to the peak
+   * usage if the last cycle overflowed.
+   */
+  void reset() {
+    releaseOverflow();
+    _used = 0;
+    _last = SIZE_MAX;
+
+    if (_peak > _capacity && _capacity < GPT_ARENA_MAX_SLAB_SIZE) {
+      if (_slab) {
+        _upstream->deallocate(_slab);
+        _slab = nullptr;
+      }
+      _capacity = align(_peak < GPT_ARENA_MAX_SLAB_SIZE ? _peak : GPT_ARENA_MAX_SLAB_SIZE);
+    }
+    _peak = 0;
+  }
+
+  /**
+   * @brief Bytes in use, including overflow blocks
+   */
+  size_t used() const { return _used + _overflowBytes; }
+
+  /**
+   * @brief Slab capacity in bytes
+   */
+  size_t capacity() const { return _capacity; }
+
+  /**
+   * @brief Number of allocations that did not fit in the slab
+   */
+  size_t overflowCount() const { return _overflowCount; }
+
+private:
+  struct Block {
+    Block* next;
+    size_t size;
+  };
+
+  static size_t align(size_t size) {
+    return (size + 7) & ~size_t(7);
+  }
+
+  bool owns(void* pointer) const {
+    return _slab && (uint8_t*) pointer >= _slab && (uint8_t*) pointer < _slab + _capacity;
+  }
+
+  void track() {
+    if (used() > _peak) {
+      _peak = used();
+    }
+  }
+
+  void releaseOverflow() {
+    while (_overflow) {
+      Block* next = _overflow->next;
+      _upstream->deallocate(_overflow);
+      _overflow = next;
+    }
+    _overflowBytes = 0;
+  }
+
+  ArduinoJson::Allocator* _upstream;
+  uint8_t* _slab;
+  size_t _capacity;
+  size_t _used;
+  size_t _last;
+  Block* _overflow;
+  size_t _overflowBytes;
+  size_t _peak;
+  size_t _overflowCount;
+};
+
+// Number of documents kept by GPTJsonDocumentPool
+#ifndef GPT_JSON_POOL_SIZE
+#define GPT_JSON_POOL_SIZE 4
+#endif
+
+/**
+ * Small pool of pre-warmed JSON documents. Each document is backed by its
+ * own arena, so memory is retained across leases and steady-state parsing
+ * performs no allocator calls. When every document is leased a temporary
+ * one is created and counted as a miss.
+ */
+class GPTJsonDocumentPool {
+  struct Slot {
+    GPTArenaAllocator arena;
+    ArduinoJson::JsonDocument doc;
+    bool busy;
+    bool pooled;
+
+    Slot() : arena(), doc(&arena), busy(false), pooled(true) {}
+  };
+
+public:
+  struct Stats {
+    size_t size;        // documents in the pool
+    size_t inUse;       // documents currently leased
+    size_t peakInUse;   // highest concurrent leases
+    uint32_t leases;    // total leases
+    uint32_t misses;    // leases served outside the pool
+  };
+
+  /**
+   * Leased document, returned to the pool when destroyed
+   */
+  class Lease {
+  public:
+    Lease() : _pool(nullptr), _slot(nullptr) {}
+    Lease(GPTJsonDocumentPool* pool, Slot* slot) : _pool(pool), _slot(slot) {}
+    Lease(Lease&& other) : _pool(other._pool), _slot(other._slot) {
+      other._slot = nullptr;
+    }
+    Lease& operator=(Lease&& other) {
+      if (this != &other) {
+        release();
+        _pool = other._pool;
+        _slot = other._slot;
+        other._slot = nullptr;
+      }
+      return *this;
+    }
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease() { release(); }
+
+    ArduinoJson::JsonDocument& operator*() const { return _slot->doc; }
+    ArduinoJson::JsonDocument* operator->() const { return &_slot->doc; }
+    explicit operator bool() const { return _slot != nullptr; }
+
+  private:
+    void release() {
+      if (_slot) {
+        _pool->release(_slot);
+        _slot = nullptr;
+      }
+    }
+
+    GPTJsonDocumentPool* _pool;
+    Slot* _slot;
+  };
+
+  GPTJsonDocumentPool() : _stats{GPT_JSON_POOL_SIZE, 0, 0, 0, 0} {}
+
+  /**
+   * @brief Allocate every slab up front
+   */
+  void warmUp() {
+    for (Slot& slot : _slots) {
+      slot.arena.reserve();
+    }
+  }
+
+  /**
+   * @brief Lease an empty document
+   * @return Lease holding the document
+   */
+  Lease lease() {
+    Slot* slot = nullptr;
+
+    portENTER_CRITICAL(&_lock);
+    for (Slot& candidate : _slots) {
+      if (!candidate.busy) {
+        candidate.busy = true;
+        slot = &candidate;
+        break;
+      }
+    }
+    _stats.leases++;
+    if (!slot) {
+      _stats.misses++;
+    }
+    _stats.inUse++;
+    if (_stats.inUse > _stats.peakInUse) {
+      _stats.peakInUse = _stats.inUse;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (!slot) {
+      slot = new Slot();
+      slot->busy = true;
+      slot->pooled = false;
+    }
+    return Lease(this, slot);
+  }
+
+  /**
+   * @brief Get utilisation counters
+   * @return Snapshot of the pool statistics
+   */
+  Stats stats() const {
+    portENTER_CRITICAL(&_lock);
+    Stats stats = _stats;
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+  }
+
+private:
+  void release(Slot* slot) {
+    slot->doc.clear();
+    slot->arena.reset();
+
+    bool pooled = slot->pooled;
+    if (!pooled) {
+      delete slot;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    if (pooled) {
+      slot->busy = false;
+    }
+    _stats.inUse--;
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  Slot _slots[GPT_JSON_POOL_SIZE];
+  Stats _stats;
+  mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
 class GPTWifiClient : public NetworkClientSecure {
 public:
 	GPTWifiClient(){}
 	~GPTWifiClient(){}
+
+	/**
+	 * Connect by host name, resolving it through gptDns. The host name is
+	 * still passed to TLS for SNI and certificate checks.
+	 */
+	int connect(const char *host, uint16_t port, int32_t timeout) override {
+		IPAddress address;
+		if (_pskIdent != nullptr || !gptDns->resolve(host, address)) {
+			return NetworkClientSecure::connect(host, port, timeout);
+		}
+
+		_timeout = timeout;
+		int ret = NetworkClientSecure::connect(address, port, host, _CA_cert, _cert, _private_key);
+		if (!ret) {
+			// the address may have moved, look it up again next time
+			gptDns->invalidate(host);
+		}
+		return ret;
+	}
+
+	using NetworkClientSecure::connect;
 private:
 	inline char* _streamLoad(Stream &stream, size_t size) {
 		char *dest = (char *) heap_caps_malloc(size + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
@@ -100,10 +831,655 @@ private:
 	}
 };
 
-class GPTClient : public HTTPClient {
-public:
-  GPTClient(){}
-  ~GPTClient(){}
+#if GPT_HTTP_DECOMPRESSION
+/**
+ * Streaming gzip / zlib decoder in front of any Print. Compressed bytes
+ * are written in arbitrary pieces, decompressed bytes are forwarded as
+ * they come out. Without a Print the decoded bytes are pulled with
+ * inflate() instead. Decoder state and the 32 KB deflate window live in PSRAM.
+ */
+class GPTInflater : public Stream {
+public:
+  enum Format {
+    GPT_INFLATE_GZIP,
+    GPT_INFLATE_ZLIB
+  };
+
+  GPTInflater(Print &out, Format format) : GPTInflater(format) {
+    _out = &out;
+  }
+
+  explicit GPTInflater(Format format)
+    : _out(nullptr), _format(format), _decompressor(nullptr), _window(nullptr), _windowPos(0),
+      _status(TINFL_STATUS_NEEDS_MORE_INPUT), _failed(false),
+      _gzipState(format == GPT_INFLATE_GZIP ? GZIP_FIXED : GZIP_BODY), _gzipFlags(0), _gzipPos(0), _gzipExtra(0),
+      _compressed(0), _decompressed(0) {}
+
+  ~GPTInflater() {
+    heap_caps_free(_decompressor);
+  }
+
+  GPTInflater(const GPTInflater &) = delete;
+  GPTInflater &operator=(const GPTInflater &) = delete;
+
+  /**
+   * @brief Allocate the decoder state and window
+   * @return true if the memory is available
+   */
+  bool begin() {
+    if (!_decompressor) {
+      _decompressor = (tinfl_decompressor *) heap_caps_malloc(sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
+      if (!_decompressor) {
+        return false;
+      }
+      _window = (uint8_t *) (_decompressor + 1);
+    }
+    tinfl_init(_decompressor);
+    _windowPos = 0;
+    _status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    _failed = false;
+    return true;
+  }
+
+  bool done() const { return _status == TINFL_STATUS_DONE; }
+  bool failed() const { return _failed; }
+  bool hasMoreOutput() const { return _status == TINFL_STATUS_HAS_MORE_OUTPUT; }
+  size_t compressedBytes() const { return _compressed; }
+  size_t decompressedBytes() const { return _decompressed; }
+
+  // Print
+  using Print::write;
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *data, size_t size) override {
+    if (_failed || !_decompressor || !_out) {
+      return 0;
+    }
+
+    // Trailing bytes after the end of the stream (gzip CRC / size) are dropped
+    size_t left = size;
+    while (!_failed && _status != TINFL_STATUS_DONE && (left > 0 || hasMoreOutput())) {
+      const uint8_t *out;
+      size_t outSize = inflate(data, left, out);
+      if (outSize > 0 && _out->write(out, outSize) != outSize) {
+        _failed = true;
+      }
+    }
+
+    _compressed += left;
+    return _failed ? 0 : size;
+  }
+
+  /**
+   * @brief Decode the next piece of compressed input
+   * @param data const uint8_t *&  input, advanced past the consumed bytes
+   * @param size size_t &  input left, reduced by the consumed bytes
+   * @param out const uint8_t *&  decoded bytes, valid until the next call
+   * @return number of decoded bytes at out, 0 when more input is needed
+   */
+  size_t inflate(const uint8_t *&data, size_t &size, const uint8_t *&out) {
+    if (_failed || !_decompressor || _status == TINFL_STATUS_DONE) {
+      return 0;
+    }
+
+    if (_gzipState != GZIP_BODY) {
+      size_t skipped = skipGzipHeader(data, size);
+      data += skipped;
+      size -= skipped;
+      _compressed += skipped;
+      if (_failed || _gzipState != GZIP_BODY) {
+        return 0;
+      }
+    }
+
+    int flags = TINFL_FLAG_HAS_MORE_INPUT;
+    if (_format == GPT_INFLATE_ZLIB) {
+      flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+    }
+
+    size_t inSize = size;
+    size_t outSize = TINFL_LZ_DICT_SIZE - _windowPos;
+    out = _window + _windowPos;
+    _status = tinfl_decompress(_decompressor, data, &inSize, _window, _window + _windowPos, &outSize, flags);
+    data += inSize;
+    size -= inSize;
+    _compressed += inSize;
+    _windowPos = (_windowPos + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+    _decompressed += outSize;
+
+    if (_status < TINFL_STATUS_DONE) {
+      GPT_LOGW(HTTP, "inflate failed: %d", _status);
+      _failed = true;
+    }
+    return outSize;
+  }
+
+  // Stream, nothing to read back
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+
+private:
+  // Gzip member header (RFC 1952) in front of the deflate data
+  enum GzipState {
+    GZIP_FIXED,      // ID1 ID2 CM FLG MTIME XFL OS
+    GZIP_EXTRA_LEN,
+    GZIP_EXTRA,
+    GZIP_NAME,
+    GZIP_COMMENT,
+    GZIP_HCRC,
+    GZIP_BODY
+  };
+
+  bool wantsGzipState(int state) const {
+    switch (state) {
+      case GZIP_EXTRA_LEN:
+      case GZIP_EXTRA: return _gzipFlags & 0x04;
+      case GZIP_NAME: return _gzipFlags & 0x08;
+      case GZIP_COMMENT: return _gzipFlags & 0x10;
+      case GZIP_HCRC: return _gzipFlags & 0x02;
+      default: return true;
+    }
+  }
+
+  void nextGzipState() {
+    _gzipPos = 0;
+    do {
+      _gzipState = (GzipState) (_gzipState + 1);
+    } while (_gzipState != GZIP_BODY && !wantsGzipState(_gzipState));
+  }
+
+  size_t skipGzipHeader(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    while (i < size && _gzipState != GZIP_BODY) {
+      uint8_t c = data[i++];
+      switch (_gzipState) {
+        case GZIP_FIXED:
+          if ((_gzipPos == 0 && c != 0x1f) || (_gzipPos == 1 && c != 0x8b) || (_gzipPos == 2 && c != 8)) {
+            GPT_LOGW(HTTP, "not a gzip stream");
+            _failed = true;
+            return i;
+          }
+          if (_gzipPos == 3) {
+            _gzipFlags = c;
+          }
+          if (++_gzipPos == 10) {
+            nextGzipState();
+          }
+          break;
+        case GZIP_EXTRA_LEN:
+          _gzipExtra |= c << (8 * _gzipPos);
+          if (++_gzipPos == 2) {
+            nextGzipState();
+            if (_gzipExtra == 0) {
+              nextGzipState();
+            }
+          }
+          break;
+        case GZIP_EXTRA:
+          if (++_gzipPos == _gzipExtra) {
+            nextGzipState();
+          }
+          break;
+        case GZIP_NAME:
+        case GZIP_COMMENT:
+          if (c == 0) {
+            nextGzipState();
+          }
+          break;
+        case GZIP_HCRC:
+          if (++_gzipPos == 2) {
+            nextGzipState();
+          }
+          break;
+        default:
+          break;
+      }
+    }
+    return i;
+  }
+
+  Print *_out;
+  Format _format;
+  tinfl_decompressor *_decompressor;
+  uint8_t *_window;
+  size_t _windowPos;
+  tinfl_status _status;
+  bool _failed;
+  GzipState _gzipState;
+  uint8_t _gzipFlags;
+  size_t _gzipPos;
+  size_t _gzipExtra;
+  size_t _compressed;
+  size_t _decompressed;
+};
+#endif
+
+// Socket tuning for the kind of traffic a transport carries
+enum class GPTTransportProfile {
+  GPT_INTERACTIVE, // small requests, waiting on the answer
+  GPT_BULK,        // large uploads / downloads
+  GPT_REALTIME     // continuous small frames in both directions
+};
+
+struct GPTSocketOptions {
+  bool noDelay;          // disable Nagle
+  int sendBuffer;        // SO_SNDBUF, 0 keeps the stack default
+  int receiveBuffer;     // SO_RCVBUF, 0 keeps the stack default
+  bool keepAlive;        // TCP keepalive probes
+  int keepIdle;          // s idle before the first probe
+  int keepInterval;      // s between probes
+  int keepCount;         // unanswered probes before the connection drops
+  size_t recordSize;     // max bytes per TLS write / record, 0 for the whole TX buffer
+
+  static constexpr GPTSocketOptions forProfile(GPTTransportProfile profile) {
+    switch (profile) {
+      case GPTTransportProfile::GPT_BULK:
+        return {false, 0, 0, true, 60, 10, 3, 0};
+      case GPTTransportProfile::GPT_REALTIME:
+        return {true, 0, 0, true, 10, 2, 3, 1360};
+      case GPTTransportProfile::GPT_INTERACTIVE:
+      default:
+        return {true, 0, 0, true, 30, 5, 3, 1360};
+    }
+  }
+};
+
+// Size of the transmit / receive buffers owned by GPTClient
+#ifndef GPT_HTTP_TX_BUFFER_SIZE
+#define GPT_HTTP_TX_BUFFER_SIZE HTTP_TCP_TX_BUFFER_SIZE
+#endif
+
+#ifndef GPT_HTTP_RX_BUFFER_SIZE
+#define GPT_HTTP_RX_BUFFER_SIZE HTTP_TCP_RX_BUFFER_SIZE
+#endif
+
+// Kept-alive connections idle for longer are closed before the next
+// request instead of risking a write into a socket the server dropped
+#ifndef GPT_HTTP_KEEPALIVE_MS
+#define GPT_HTTP_KEEPALIVE_MS 30000
+#endif
+
+// Longest a whole request body may take to send, 0 for no limit. A write
+// that makes no progress for the TCP timeout fails on its own.
+#ifndef GPT_HTTP_BODY_TIMEOUT_MS
+#define GPT_HTTP_BODY_TIMEOUT_MS (10 * 60 * 1000)
+#endif
+
+// How often background work polls for the shared connection to be idle
+#ifndef GPT_HTTP_IDLE_POLL_MS
+#define GPT_HTTP_IDLE_POLL_MS 250
+#endif
+
+// Room kept in front of / behind a chunk in the TX buffer for its framing
+#define GPT_HTTP_CHUNK_HEADER_SIZE 10  // "FFFFFFFF\r\n"
+#define GPT_HTTP_CHUNK_TRAILER_SIZE 2  // "\r\n"
+
+#if !GPT_HTTP_DECOMPRESSION
+class GPTInflater; // not built, bodies are read as sent
+#endif
+
+class GPTClient : public HTTPClient {
+public:
+  /**
+   * Print writing the request body through the TX buffer, see beginBody()
+   */
+  class Body : public Print {
+  public:
+    explicit Body(GPTClient &client) : _client(client) {}
+
+    using Print::write;
+
+    size_t write(uint8_t c) override {
+      return _client.writeBody(&c, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+      return _client.writeBody(buffer, size);
+    }
+
+  private:
+    GPTClient &_client;
+  };
+
+  /**
+   * Stream reading the response body from the connection for parsers that
+   * pull, removing the transfer encoding and, given an inflater, the
+   * content encoding. See deserializeBody()
+   */
+  class BodyReader : public Stream {
+  public:
+    BodyReader(GPTClient &client, GPTInflater *inflater)
+      : _client(client), _inflater(inflater), _in(nullptr), _inLength(0), _out(nullptr), _outLength(0),
+        _left(client._transferEncoding == HTTPC_TE_CHUNKED ? 0 : client._size), _chunks(0), _ended(false), _error(0) {
+      setTimeout(0); // the connection waits itself, end of body is final
+    }
+
+    int available() override {
+      return fill() ? _outLength : 0;
+    }
+
+    int read() override {
+      if (!fill()) {
+        return -1;
+      }
+      _outLength--;
+      return *_out++;
+    }
+
+    int peek() override {
+      return fill() ? *_out : -1;
+    }
+
+    using Stream::readBytes;
+
+    size_t readBytes(char *buffer, size_t length) override {
+      size_t count = 0;
+      while (count < length && fill()) {
+        size_t n = length - count < _outLength ? length - count : _outLength;
+        memcpy(buffer + count, _out, n);
+        _out += n;
+        _outLength -= n;
+        count += n;
+      }
+      return count;
+    }
+
+    // read and drop the rest of the body, keeping the connection reusable
+    void skip() {
+      while (fill()) {
+        _outLength = 0;
+      }
+      // gzip trailer and the end of a chunked body behind the decoded data
+      _inLength = 0;
+      while (receive()) {
+        _inLength = 0;
+      }
+    }
+
+    size_t write(uint8_t) override {
+      return 0;
+    }
+
+    // HTTPC_ERROR_* of the read that failed, 0 at the end of the body
+    int error() const {
+      return _error;
+    }
+
+  private:
+    // decoded bytes at _out, false at the end of the body or on error
+    bool fill() {
+      while (_outLength == 0) {
+#if GPT_HTTP_DECOMPRESSION
+        if (_inflater) {
+          if (_inflater->done() || _inflater->failed()) {
+            return false;
+          }
+          if (_inLength == 0 && !_inflater->hasMoreOutput() && !receive()) {
+            return false;
+          }
+          _outLength = _inflater->inflate(_in, _inLength, _out);
+          continue;
+        }
+#endif
+        if (!receive()) {
+          return false;
+        }
+        _out = _in;
+        _outLength = _inLength;
+        _inLength = 0;
+      }
+      return true;
+    }
+
+    // next piece of the body as sent into the RX buffer
+    bool receive() {
+      if (_ended || _error < 0) {
+        return false;
+      }
+
+      if (_client._transferEncoding == HTTPC_TE_CHUNKED && _left == 0) {
+        // trailing \r\n of the previous chunk, then the size of this one
+        char buf[2];
+        if (_chunks++ > 0 && (_client._client->readBytes((uint8_t *)buf, 2) != 2 || buf[0] != '\r' || buf[1] != '\n')) {
+          _error = HTTPC_ERROR_READ_TIMEOUT;
+          return false;
+        }
+        String chunkHeader = _client._client->readStringUntil('\n');
+        if (chunkHeader.length() <= 0) {
+          _error = HTTPC_ERROR_READ_TIMEOUT;
+          return false;
+        }
+        chunkHeader.trim();
+        _left = (int) strtol(chunkHeader.c_str(), NULL, 16);
+        GPT_LOGV(HTTP, " read chunk len: %d", _left);
+        if (_left == 0) {
+          _ended = true;
+          return false;
+        }
+      } else if (_left == 0) {
+        _ended = true;
+        return false;
+      }
+
+      uint8_t *buff = _client.rxBuffer();
+      if (!buff) {
+        GPT_LOGW(HTTP, "too less ram! need %d", _client._rxBufferSize);
+        _error = HTTPC_ERROR_TOO_LESS_RAM;
+        return false;
+      }
+
+      // read only the asked bytes
+      int readSize = _client._rxBufferSize;
+      if (_left > 0 && readSize > _left) {
+        readSize = _left;
+      }
+
+      // a body without length ends when the server closes the connection
+      int bytesRead = 0;
+      while (bytesRead == 0) {
+        if (!_client.connected()) {
+          if (_left < 0) {
+            _ended = true;
+          } else {
+            _error = HTTPC_ERROR_CONNECTION_LOST;
+          }
+          return false;
+        }
+        bytesRead = _client.readBlock(buff, readSize);
+        if (bytesRead < 0) {
+          GPT_LOGD(HTTP, "read timeout");
+          _error = HTTPC_ERROR_READ_TIMEOUT;
+          return false;
+        }
+      }
+
+      if (_left > 0) {
+        _left -= bytesRead;
+      }
+      _in = buff;
+      _inLength = bytesRead;
+      return true;
+    }
+
+    GPTClient &_client;
+    GPTInflater *_inflater;
+    const uint8_t *_in;
+    size_t _inLength;
+    const uint8_t *_out;
+    size_t _outLength;
+    int _left; // bytes left in the body or chunk, -1 until the connection closes
+    int _chunks;
+    bool _ended;
+    int _error;
+  };
+
+  GPTClient()
+    : _txBuffer(nullptr), _rxBuffer(nullptr),
+      _txBufferSize(GPT_HTTP_TX_BUFFER_SIZE), _rxBufferSize(GPT_HTTP_RX_BUFFER_SIZE),
+      _body(*this), _bodyChunked(false), _bodySize(0), _bodyFill(0), _bodySent(0), _bodyError(0), _bodyStart(0), _bodyTimeout(GPT_HTTP_BODY_TIMEOUT_MS),
+      _acceptEncoding(false), _collectsTransport(false), _keySlot(-1), _compressedBytes(0), _decompressedBytes(0),
+      _socketOptions(GPTSocketOptions::forProfile(GPTTransportProfile::GPT_INTERACTIVE)),
+      _lease(xSemaphoreCreateMutex()), _lastUse(0), _waiting(0) {}
+
+  ~GPTClient() {
+    setBufferSizes(0, 0);
+    vSemaphoreDelete(_lease);
+  }
+
+  /**
+  * take the client for one request, the services share one connection and
+  * run their requests one after the other. Call release() when done.
+  * @param timeout TickType_t  max time to wait for the running request
+  * @return false on timeout
+  */
+  inline bool acquire(TickType_t timeout = portMAX_DELAY) {
+    if (xSemaphoreTake(_lease, 0) != pdTRUE) {
+      if (timeout == 0) {
+        return false;
+      }
+      // counted so background work lets this request go first
+      _waiting++;
+      bool taken = xSemaphoreTake(_lease, timeout) == pdTRUE;
+      _waiting--;
+      if (!taken) {
+        return false;
+      }
+    }
+
+    if (_client && _client->connected() && millis() - _lastUse > GPT_HTTP_KEEPALIVE_MS) {
+      GPT_LOGD(HTTP, "kept-alive connection idle for %u ms, closing", millis() - _lastUse);
+      _client->stop();
+    }
+    return true;
+  }
+
+  /**
+  * take the client for background work, only while no other request waits
+  * for it. Backs off and retries until then, so a live request is never
+  * queued behind the background one. Call release() when done.
+  * @param timeout TickType_t  max time to wait for an idle connection
+  * @return false on timeout
+  */
+  inline bool acquireIdle(TickType_t timeout = portMAX_DELAY) {
+    TickType_t start = xTaskGetTickCount();
+    while (true) {
+      if (_waiting == 0 && acquire(0)) {
+        // a request that started waiting meanwhile still goes first
+        if (_waiting == 0) {
+          return true;
+        }
+        xSemaphoreGive(_lease);
+      }
+      if (timeout != portMAX_DELAY && xTaskGetTickCount() - start >= timeout) {
+        return false;
+      }
+      vTaskDelay(pdMS_TO_TICKS(GPT_HTTP_IDLE_POLL_MS));
+    }
+  }
+
+  /**
+  * hand the client to the next request, after end()
+  */
+  inline void release() {
+    _lastUse = millis();
+    xSemaphoreGive(_lease);
+  }
+
+  /**
+  * set size of the transmit and receive buffers, kept for the client lifetime
+  * @param txSize size_t  transmit buffer size, 0 keeps the default
+  * @param rxSize size_t  receive buffer size, 0 keeps the default
+  */
+  inline void setBufferSizes(size_t txSize, size_t rxSize) {
+    heap_caps_free(_txBuffer);
+    heap_caps_free(_rxBuffer);
+    _txBuffer = nullptr;
+    _rxBuffer = nullptr;
+    _txBufferSize = txSize > 0 ? txSize : GPT_HTTP_TX_BUFFER_SIZE;
+    _rxBufferSize = rxSize > 0 ? rxSize : GPT_HTTP_RX_BUFFER_SIZE;
+  }
+
+  /**
+  * select the socket tuning for the following requests
+  * @param profile GPTTransportProfile
+  */
+  inline void setTransportProfile(GPTTransportProfile profile) {
+    _socketOptions = GPTSocketOptions::forProfile(profile);
+  }
+
+  /**
+  * set socket tuning explicitly
+  * @param options const GPTSocketOptions &
+  */
+  inline void setSocketOptions(const GPTSocketOptions &options) {
+    _socketOptions = options;
+  }
+
+  /**
+  * ask for gzip / deflate compressed responses, decoded transparently by
+  * writeToStream(), getString() and getBody(). Stays set until changed.
+  * @param enable bool    has no effect when built without GPT_HTTP_DECOMPRESSION
+  */
+  inline void setAcceptEncoding(bool enable) {
+    _acceptEncoding = enable && GPT_HTTP_DECOMPRESSION;
+  }
+
+  /**
+  * limit the time a whole request body may take to send, independent of
+  * the TCP timeout that bounds each stall. Stays set until changed.
+  * @param timeout uint32_t  ms, 0 for no limit
+  */
+  inline void setBodyTimeout(uint32_t timeout) {
+    _bodyTimeout = timeout;
+  }
+
+  /**
+  * compressed bytes received for decoded responses since the last reset
+  */
+  inline size_t getCompressedBytes() const {
+    return _compressedBytes;
+  }
+
+  /**
+  * bytes the compressed responses decoded to since the last reset
+  */
+  inline size_t getDecompressedBytes() const {
+    return _decompressedBytes;
+  }
+
+  inline void resetCompressionStats() {
+    _compressedBytes = 0;
+    _decompressedBytes = 0;
+  }
+
+  /**
+  * collect response headers, Content-Encoding and the rate limit headers
+  * are always collected as well
+  * @param headerKeys const char *[]
+  * @param headerKeysCount size_t
+  */
+  inline void collectHeaders(const char *headerKeys[], const size_t headerKeysCount) {
+    std::vector<const char *> keys(headerKeys, headerKeys + headerKeysCount);
+    keys.insert(keys.end(), std::begin(TRANSPORT_HEADERS), std::end(TRANSPORT_HEADERS));
+    HTTPClient::collectHeaders(keys.data(), keys.size());
+    _collectsTransport = true;
+  }
+
+  /**
+  * add the Authorization header with the next key of gptKeys, or with
+  * apiKey while the pool is empty. The response is reported to the pool.
+  * @param apiKey const String &  key of the calling service
+  */
+  inline void addAuthorization(const String &apiKey) {
+    String key;
+    _keySlot = gptKeys->select(key);
+    addHeader("Authorization", "Bearer " + (_keySlot >= 0 ? key : apiKey));
+  }
 
   /**
   * sendRequest
@@ -122,6 +1498,7 @@ public:
     if (!connect()) {
       return returnError(HTTPC_ERROR_CONNECTION_REFUSED);
     }
+    applySocketOptions();
 
     if (size > 0) {
       addHeader("Content-Length", String(size));
@@ -133,119 +1510,431 @@ public:
       addHeader("Cookie", cookie_string);
     }
 
+    // advertise compressed responses, if enabled for this request
+    addTransportHeaders();
+
     // send Header
     if (!sendHeader(type)) {
       return returnError(HTTPC_ERROR_SEND_HEADER_FAILED);
     }
 
-    int buff_size = HTTP_TCP_TX_BUFFER_SIZE;
-
     int len = size;
     int bytesWritten = 0;
 
     if (len == 0) {
       len = -1;
     }
+    _bodyStart = millis();
 
-    // if possible create smaller buffer then HTTP_TCP_TX_BUFFER_SIZE
-    if ((len > 0) && (len < buff_size)) {
-      buff_size = len;
+    uint8_t *buff = txBuffer();
+    if (!buff) {
+      GPT_LOGD(HTTP, "too less ram! need %d", _txBufferSize);
+      return returnError(HTTPC_ERROR_TOO_LESS_RAM);
     }
 
-    // create buffer for read
-    uint8_t *buff = (uint8_t *) heap_caps_malloc(buff_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
+    // read all data from stream and send it to server
+    while (connected() && (len > 0 || len == -1)) {
 
-    if (buff) {
-      // read all data from stream and send it to server
-      while (connected() && (stream->available() > -1) && (len > 0 || len == -1)) {
+      int readBytes = _txBufferSize;
 
-        // get available data size
-        int sizeAvailable = stream->available();
+      // read only the asked bytes
+      if (len > 0 && readBytes > len) {
+        readBytes = len;
+      }
 
-        if (sizeAvailable) {
-          int readBytes = sizeAvailable;
+      // blocks up to the stream timeout instead of polling available()
+      int bytesRead = stream->readBytes(buff, readBytes);
+      if (bytesRead <= 0) {
+        GPT_LOGD(HTTP, "stream source drained or timed out");
+        break;
+      }
 
-          // read only the asked bytes
-          if (len > 0 && readBytes > len) {
-            readBytes = len;
-          }
+      // write it to Stream
+      if (!writeAll(buff, bytesRead)) {
+        return returnError(HTTPC_ERROR_SEND_PAYLOAD_FAILED);
+      }
+      bytesWritten += bytesRead;
 
-          // not read more the buffer can handle
-          if (readBytes > buff_size) {
-            readBytes = buff_size;
-          }
+      // count bytes to read left
+      if (len > 0) {
+        len -= bytesRead;
+      }
+    }
 
-          // read data
-          int bytesRead = stream->readBytes(buff, readBytes);
+    if (size && (int)size != bytesWritten) {
+      GPT_LOGD(HTTP, "Stream payload bytesWritten %d and size %d mismatch!.", bytesWritten, size);
+      GPT_LOGD(HTTP, "ERROR SEND PAYLOAD FAILED!");
+      return returnError(HTTPC_ERROR_SEND_PAYLOAD_FAILED);
+    } else {
+      GPT_LOGD(HTTP, "Stream payload written: %d", bytesWritten);
+    }
 
-          // write it to Stream
-          int bytesWrite = _client->write((const uint8_t *)buff, bytesRead);
-          bytesWritten += bytesWrite;
+    // handle Server Response (Header)
+    return returnError(receiveHeaders());
+  }
 
-          // are all Bytes a written to stream ?
-          if (bytesWrite != bytesRead) {
-            log_d("short write, asked for %d but got %d retry...", bytesRead, bytesWrite);
+  /**
+  * connect and send the request header, the body is then written with
+  * body() / writeBody() and the request completed with endBody()
+  * @param type const char *     "GET", "POST", ....
+  * @param size size_t           size of the body, 0 sends it with chunked transfer encoding
+  * @return 0 on success, negative values are error codes
+  */
+  inline int beginBody(const char *type, size_t size) {
+    if (!connect()) {
+      return returnError(HTTPC_ERROR_CONNECTION_REFUSED);
+    }
+    applySocketOptions();
 
-            // check for write error
-            if (_client->getWriteError()) {
-              log_d("stream write error %d", _client->getWriteError());
+    if (!txBuffer()) {
+      GPT_LOGD(HTTP, "too less ram! need %d", _txBufferSize);
+      return returnError(HTTPC_ERROR_TOO_LESS_RAM);
+    }
 
-              //reset write error for retry
-              _client->clearWriteError();
-            }
+    if (size > 0) {
+      addHeader("Content-Length", String(size));
+    } else {
+      addHeader("Transfer-Encoding", "chunked");
+    }
 
-            // some time for the stream
-            delay(1);
+    // add cookies to header, if present
+    String cookie_string;
+    if (generateCookieString(&cookie_string)) {
+      addHeader("Cookie", cookie_string);
+    }
 
-            int leftBytes = (readBytes - bytesWrite);
+    // advertise compressed responses, if enabled for this request
+    addTransportHeaders();
 
-            // retry to send the missed bytes
-            bytesWrite = _client->write((const uint8_t *)(buff + bytesWrite), leftBytes);
-            bytesWritten += bytesWrite;
+    if (!sendHeader(type)) {
+      return returnError(HTTPC_ERROR_SEND_HEADER_FAILED);
+    }
 
-            if (bytesWrite != leftBytes) {
-              // failed again
-              log_d("short write, asked for %d but got %d failed.", leftBytes, bytesWrite);
-              heap_caps_free(buff);
-              return returnError(HTTPC_ERROR_SEND_PAYLOAD_FAILED);
-            }
-          }
+    _bodyChunked = size == 0;
+    _bodySize = size;
+    _bodyFill = 0;
+    _bodySent = 0;
+    _bodyError = 0;
+    _bodyStart = millis();
+    return 0;
+  }
 
-          // check for write error
-          if (_client->getWriteError()) {
-            log_d("stream write error %d", _client->getWriteError());
-            heap_caps_free(buff);
-            return returnError(HTTPC_ERROR_SEND_PAYLOAD_FAILED);
-          }
+  /**
+  * Print for the body of the request started with beginBody()
+  */
+  inline Print &body() {
+    return _body;
+  }
 
-          // count bytes to read left
-          if (len > 0) {
-          len -= readBytes;
-          }
+  /**
+  * append body data, sent whenever the TX buffer is full
+  * @param data const uint8_t *
+  * @param size size_t
+  * @return bytes accepted, less than size after a send error
+  */
+  inline size_t writeBody(const uint8_t *data, size_t size) {
+    size_t written = 0;
+    while (written < size && _bodyError == 0) {
+      size_t space = bodyCapacity() - _bodyFill;
+      if (space == 0) {
+        flushBody();
+        continue;
+      }
+      size_t count = size - written;
+      if (count > space) {
+        count = space;
+      }
+      memcpy(bodyData() + _bodyFill, data + written, count);
+      _bodyFill += count;
+      written += count;
+    }
+    return written;
+  }
 
-          delay(0);
-        } else {
-          delay(1);
-        }
+  /**
+  * append body data read from a stream straight into the TX buffer
+  * @param source Stream &
+  * @param size size_t       bytes to take from the stream
+  * @return bytes accepted, less than size if the source ran dry or a send failed
+  */
+  inline size_t writeBody(Stream &source, size_t size) {
+    size_t written = 0;
+    while (written < size && _bodyError == 0) {
+      size_t space = bodyCapacity() - _bodyFill;
+      if (space == 0) {
+        flushBody();
+        continue;
+      }
+      size_t count = size - written;
+      if (count > space) {
+        count = space;
+      }
+      count = source.readBytes((char *)(bodyData() + _bodyFill), count);
+      if (count == 0) {
+        GPT_LOGD(HTTP, "body source drained or timed out");
+        break;
       }
+      _bodyFill += count;
+      written += count;
+    }
+    return written;
+  }
 
-      heap_caps_free(buff);
+  /**
+  * send the rest of the body and handle the response header
+  * @return http code, negative values are error codes
+  */
+  inline int endBody() {
+    flushBody();
+    if (_bodyError == 0 && _bodyChunked && !writeAll((const uint8_t *)"0\r\n\r\n", 5)) {
+      _bodyError = HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+    if (_bodyError != 0) {
+      return returnError(_bodyError);
+    }
 
-      if (size && (int)size != bytesWritten) {
-      log_d("Stream payload bytesWritten %d and size %d mismatch!.", bytesWritten, size);
-      log_d("ERROR SEND PAYLOAD FAILED!");
+    if (!_bodyChunked && _bodySent != _bodySize) {
+      GPT_LOGD(HTTP, "body bytesWritten %d and size %d mismatch!.", _bodySent, _bodySize);
       return returnError(HTTPC_ERROR_SEND_PAYLOAD_FAILED);
-      } else {
-      log_d("Stream payload written: %d", bytesWritten);
+    }
+    GPT_LOGD(HTTP, "body written: %d", _bodySent);
+
+    // handle Server Response (Header)
+    return returnError(receiveHeaders());
+  }
+
+  /**
+  * send a request without body, with socket tuning and compressed responses
+  * @param type const char *     "GET", "DELETE", ....
+  * @return http code, negative values are error codes
+  */
+  inline int sendRequest(const char *type) {
+    if (!connect()) {
+      return returnError(HTTPC_ERROR_CONNECTION_REFUSED);
+    }
+    applySocketOptions();
+
+    // add cookies to header, if present
+    String cookie_string;
+    if (generateCookieString(&cookie_string)) {
+      addHeader("Cookie", cookie_string);
+    }
+
+    // advertise compressed responses, if enabled for this request
+    addTransportHeaders();
+
+    if (!sendHeader(type)) {
+      return returnError(HTTPC_ERROR_SEND_HEADER_FAILED);
+    }
+    return returnError(receiveHeaders());
+  }
+
+  inline int GET() {
+    return sendRequest("GET");
+  }
+
+  /**
+  * send a JSON document as request body, serialized straight into the TX buffer
+  * @param type const char *     "POST", "PUT", ....
+  * @param doc JsonVariantConst
+  * @return http code, negative values are error codes
+  */
+  inline int sendJson(const char *type, JsonVariantConst doc) {
+    int ret = beginBody(type, measureJson(doc));
+    if (ret < 0) {
+      return ret;
+    }
+    serializeJson(doc, _body);
+    return endBody();
+  }
+
+  /**
+  * write all message body data to Stream, decoding chunked transfer encoding
+  * and gzip / deflate content encoding
+  * @param stream Stream *
+  * @return bytes written ( negative values are error codes )
+  */
+  inline int writeToStream(Stream *stream) {
+    if (!stream) {
+      return returnError(HTTPC_ERROR_NO_STREAM);
+    }
+
+#if GPT_HTTP_DECOMPRESSION
+    String encoding = _acceptEncoding && _collectsTransport ? header("Content-Encoding") : String();
+    bool gzip = encoding.equalsIgnoreCase("gzip");
+    if (gzip || encoding.equalsIgnoreCase("deflate")) {
+      GPTInflater inflater(*stream, gzip ? GPTInflater::GPT_INFLATE_GZIP : GPTInflater::GPT_INFLATE_ZLIB);
+      if (!inflater.begin()) {
+        GPT_LOGW(HTTP, "too less ram for inflate!");
+        return returnError(HTTPC_ERROR_TOO_LESS_RAM);
+      }
+
+      int ret = writeBodyToStream(&inflater);
+      _compressedBytes += inflater.compressedBytes();
+      _decompressedBytes += inflater.decompressedBytes();
+      if (ret < 0) {
+        return ret;
+      }
+      if (!inflater.done()) {
+        GPT_LOGW(HTTP, "compressed body incomplete or corrupt");
+        return returnError(HTTPC_ERROR_STREAM_WRITE);
+      }
+      GPT_LOGD(HTTP, "inflated %d bytes to %d", inflater.compressedBytes(), inflater.decompressedBytes());
+      return inflater.decompressedBytes();
+    }
+#endif
+
+    return writeBodyToStream(stream);
+  }
+
+protected:
+  /**
+  * write the message body as received, only the transfer encoding is removed
+  * @param stream Stream *
+  * @return bytes written ( negative values are error codes )
+  */
+  inline int writeBodyToStream(Stream *stream) {
+
+    if (!connected()) {
+      return returnError(HTTPC_ERROR_NOT_CONNECTED);
+    }
+
+    int ret = 0;
+    if (_transferEncoding == HTTPC_TE_IDENTITY) {
+      ret = writeToStreamDataBlock(stream, _size);
+      if (ret < 0) {
+        return returnError(ret);
       }
+    } else if (_transferEncoding == HTTPC_TE_CHUNKED) {
+      int size = 0;
+      while (true) {
+        if (!connected()) {
+          return returnError(HTTPC_ERROR_CONNECTION_LOST);
+        }
+
+        String chunkHeader = _client->readStringUntil('\n');
+        if (chunkHeader.length() <= 0) {
+          return returnError(HTTPC_ERROR_READ_TIMEOUT);
+        }
+        chunkHeader.trim();
+
+        // read size of chunk
+        int len = (int) strtol(chunkHeader.c_str(), NULL, 16);
+        size += len;
+        GPT_LOGV(HTTP, " read chunk len: %d", len);
+
+        if (len == 0) {
+          if (_size <= 0) {
+            _size = size;
+          }
+          break;
+        }
 
+        int r = writeToStreamDataBlock(stream, len);
+        if (r < 0) {
+          return returnError(r);
+        }
+        ret += r;
+
+        // read trailing \r\n at the end of the chunk
+        char buf[2];
+        if (_client->readBytes((uint8_t *)buf, 2) != 2 || buf[0] != '\r' || buf[1] != '\n') {
+          return returnError(HTTPC_ERROR_READ_TIMEOUT);
+        }
+      }
     } else {
-      log_d("too less ram! need %d", buff_size);
+      return returnError(HTTPC_ERROR_ENCODING);
+    }
+
+    disconnect(true);
+    return ret;
+  }
+
+public:
+  /**
+  * return all payload as String (may need lot of ram or trigger out of memory!)
+  * @return String
+  */
+  inline String getString(void) {
+    StreamString sstring;
+    if (_size > 0 && !sstring.reserve(_size + 1)) {
+      GPT_LOGD(HTTP, "not enough memory to reserve a string! need: %d", (_size + 1));
+      return "";
+    }
+    writeToStream(&sstring);
+    return sstring;
+  }
+
+  /**
+  * read the whole payload into a PSRAM buffer
+  * @param body GPTString &   destination, appended to
+  * @return bytes read ( negative values are error codes )
+  */
+  inline int getBody(GPTString &body) {
+    if (_size > 0 && !body.reserve(body.length() + _size)) {
+      GPT_LOGD(HTTP, "not enough memory to reserve the body! need: %d", _size);
       return returnError(HTTPC_ERROR_TOO_LESS_RAM);
     }
+    return writeToStream(&body);
+  }
 
-    // handle Server Response (Header)
-    return returnError(handleHeaderResponse());
+  /**
+  * parse the payload as JSON while it is read from the connection, decoding
+  * gzip / deflate content encoding, so the body is never held in memory
+  * @param doc JsonDocument &          destination
+  * @param filter const JsonDocument & fields to keep
+  * @return parse result, IncompleteInput when the body could not be read
+  */
+  inline DeserializationError deserializeBody(JsonDocument &doc, const JsonDocument &filter) {
+    if (!connected()) {
+      returnError(HTTPC_ERROR_NOT_CONNECTED);
+      return DeserializationError::IncompleteInput;
+    }
+
+    GPTInflater *inflater = nullptr;
+#if GPT_HTTP_DECOMPRESSION
+    String encoding = _acceptEncoding && _collectsTransport ? header("Content-Encoding") : String();
+    bool gzip = encoding.equalsIgnoreCase("gzip");
+    GPTInflater decoder(gzip ? GPTInflater::GPT_INFLATE_GZIP : GPTInflater::GPT_INFLATE_ZLIB);
+    if (gzip || encoding.equalsIgnoreCase("deflate")) {
+      if (!decoder.begin()) {
+        GPT_LOGW(HTTP, "too less ram for inflate!");
+        returnError(HTTPC_ERROR_TOO_LESS_RAM);
+        return DeserializationError::NoMemory;
+      }
+      inflater = &decoder;
+    }
+#endif
+
+    BodyReader reader(*this, inflater);
+    DeserializationError error = deserializeJson(doc, reader, DeserializationOption::Filter(filter));
+    if (!error) {
+      reader.skip(); // whitespace or gzip trailer behind the document
+    }
+
+#if GPT_HTTP_DECOMPRESSION
+    if (inflater) {
+      _compressedBytes += inflater->compressedBytes();
+      _decompressedBytes += inflater->decompressedBytes();
+      GPT_LOGD(HTTP, "inflated %d bytes to %d", inflater->compressedBytes(), inflater->decompressedBytes());
+    }
+#endif
+
+    if (reader.error() < 0) {
+      returnError(reader.error());
+      if (!error) {
+        error = DeserializationError::IncompleteInput;
+      }
+      return error;
+    }
+    if (error) {
+      // the rest of the body is still on the connection
+      disconnect(false);
+      return error;
+    }
+
+    disconnect(true);
+    return error;
   }
 
   /**
@@ -255,119 +1944,341 @@ public:
   * @return < 0 = error >= 0 = size written
   */
   inline int writeToStreamDataBlock(Stream *stream, int size) {
-    int buff_size = HTTP_TCP_RX_BUFFER_SIZE;
     int len = size;
     int bytesWritten = 0;
 
-    // if possible create smaller buffer then HTTP_TCP_RX_BUFFER_SIZE
-    if ((len > 0) && (len < buff_size)) {
-      buff_size = len;
+    uint8_t *buff = rxBuffer();
+    if (!buff) {
+      GPT_LOGW(HTTP, "too less ram! need %d", _rxBufferSize);
+      return HTTPC_ERROR_TOO_LESS_RAM;
     }
 
-    // create buffer for read
-    uint8_t *buff = (uint8_t *) heap_caps_malloc(buff_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
+    // read all data from server
+    while (connected() && (len > 0 || len == -1)) {
+
+      int readBytes = _rxBufferSize;
+
+      // read only the asked bytes
+      if (len > 0 && readBytes > len) {
+        readBytes = len;
+      }
 
-    if (buff) {
-      // read all data from server
-      while (connected() && (len > 0 || len == -1)) {
+      // wait for data with the client timeout instead of polling
+      int bytesRead = readBlock(buff, readBytes);
+      if (bytesRead < 0) {
+        GPT_LOGD(HTTP, "read timeout");
+        break;
+      }
+      if (bytesRead == 0) {
+        continue;
+      }
 
-        // get available data size
-        size_t sizeAvailable = buff_size;
-        if (len < 0) {
-          sizeAvailable = _client->available();
+      // write it to Stream, short writes continue while the sink makes progress
+      int bytesWrite = 0;
+      while (bytesWrite < bytesRead) {
+        int count = stream->write(buff + bytesWrite, bytesRead - bytesWrite);
+        if (count <= 0) {
+          break;
         }
+        bytesWrite += count;
+      }
+      bytesWritten += bytesWrite;
 
-        if (sizeAvailable) {
+      if (bytesWrite != bytesRead) {
+        GPT_LOGW(HTTP, "short write asked for %d but got %d failed.", bytesRead, bytesWrite);
+        return HTTPC_ERROR_STREAM_WRITE;
+      }
 
-          int readBytes = sizeAvailable;
+      // check for write error
+      if (stream->getWriteError()) {
+        GPT_LOGW(HTTP, "stream write error %d", stream->getWriteError());
+        return HTTPC_ERROR_STREAM_WRITE;
+      }
 
-          // read only the asked bytes
-          if (len > 0 && readBytes > len) {
-            readBytes = len;
-          }
+      // count bytes to read left
+      if (len > 0) {
+        len -= bytesRead;
+      }
+    }
 
-          // not read more the buffer can handle
-          if (readBytes > buff_size) {
-            readBytes = buff_size;
-          }
+    GPT_LOGV(HTTP, "connection closed or file end (written: %d).", bytesWritten);
 
-          // stop if no more reading
-          if (readBytes == 0) {
-            break;
-          }
+    if ((size > 0) && (size != bytesWritten)) {
+      GPT_LOGD(HTTP, "bytesWritten %d and size %d mismatch!.", bytesWritten, size);
+      return HTTPC_ERROR_STREAM_WRITE;
+    }
 
-          // read data
-          int bytesRead = _client->readBytes(buff, readBytes);
+    return bytesWritten;
+  }
 
-          // write it to Stream
-          int bytesWrite = stream->write(buff, bytesRead);
-          bytesWritten += bytesWrite;
+protected:
+  /**
+  * apply the socket options of the transport profile to the connection
+  */
+  inline void applySocketOptions() {
+    int fd = _client->fd();
+    if (fd < 0) {
+      return;
+    }
 
-          // are all Bytes a written to stream ?
-          if (bytesWrite != bytesRead) {
-            log_d("short write asked for %d but got %d retry...", bytesRead, bytesWrite);
+    int value = _socketOptions.noDelay ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
 
-            // check for write error
-            if (stream->getWriteError()) {
-              log_d("stream write error %d", stream->getWriteError());
+    // lwIP only honours these when built with LWIP_SO_SNDBUF / LWIP_SO_RCVBUF
+    if (_socketOptions.sendBuffer > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &_socketOptions.sendBuffer, sizeof(int)) < 0) {
+      GPT_LOGD(HTTP, "SO_SNDBUF not supported");
+    }
+    if (_socketOptions.receiveBuffer > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &_socketOptions.receiveBuffer, sizeof(int)) < 0) {
+      GPT_LOGD(HTTP, "SO_RCVBUF not supported");
+    }
 
-              //reset write error for retry
-              stream->clearWriteError();
-            }
+    value = _socketOptions.keepAlive ? 1 : 0;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value));
+    if (_socketOptions.keepAlive) {
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &_socketOptions.keepIdle, sizeof(int));
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &_socketOptions.keepInterval, sizeof(int));
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &_socketOptions.keepCount, sizeof(int));
+    }
+  }
 
-            // some time for the stream
-            delay(1);
+  /**
+  * add Accept-Encoding when compressed responses are enabled and make
+  * sure Content-Encoding and the rate limit headers are collected
+  */
+  inline void addTransportHeaders() {
+    if (_acceptEncoding) {
+      addHeader("Accept-Encoding", "gzip, deflate");
+    }
+    if (!_collectsTransport) {
+      collectHeaders(nullptr, 0);
+    }
 
-            int leftBytes = (bytesRead - bytesWrite);
+    // collected values survive from the previous response
+    for (size_t i = 0; i < _headerKeysCount; i++) {
+      for (const char *key : TRANSPORT_HEADERS) {
+        if (_currentHeaders[i].key.equalsIgnoreCase(key)) {
+          _currentHeaders[i].value = "";
+        }
+      }
+    }
+  }
 
-            // retry to send the missed bytes
-            bytesWrite = stream->write((buff + bytesWrite), leftBytes);
-            bytesWritten += bytesWrite;
+  /**
+  * read the response header and report it to the key it was sent with
+  * @return http code, negative values are error codes
+  */
+  inline int receiveHeaders() {
+    int code = handleHeaderResponse();
+    if (_keySlot >= 0 && code > 0) {
+      GPTRateLimitHeaders limits;
+      limits.remainingRequests = header("x-ratelimit-remaining-requests");
+      limits.remainingTokens = header("x-ratelimit-remaining-tokens");
+      limits.resetRequests = header("x-ratelimit-reset-requests");
+      limits.resetTokens = header("x-ratelimit-reset-tokens");
+      limits.retryAfter = header("retry-after");
+      gptKeys->report(_keySlot, code, limits);
+    }
+    _keySlot = -1;
+    return code;
+  }
 
-            if (bytesWrite != leftBytes) {
-              // failed again
-              log_w("short write asked for %d but got %d failed.", leftBytes, bytesWrite);
-              heap_caps_free(buff);
-              return HTTPC_ERROR_STREAM_WRITE;
-            }
-          }
+  /**
+  * write the whole buffer to the connection, driven by socket writability
+  * @param buff const uint8_t *
+  * @param size size_t
+  * @return true if everything was written
+  */
+  inline bool writeAll(const uint8_t *buff, size_t size) {
+    // one TLS record per write, small records leave the device sooner
+    size_t record = _socketOptions.recordSize;
+    if (record > 0 && size > record) {
+      for (size_t offset = 0; offset < size; offset += record) {
+        if (!writeAll(buff + offset, size - offset < record ? size - offset : record)) {
+          return false;
+        }
+      }
+      return true;
+    }
 
-          // check for write error
-          if (stream->getWriteError()) {
-            log_w("stream write error %d", stream->getWriteError());
-            heap_caps_free(buff);
-            return HTTPC_ERROR_STREAM_WRITE;
-          }
+    // keep writing what is left, waiting for the socket to drain in
+    // between, until everything is out, no byte was accepted for the TCP
+    // timeout or the body timeout counted from the start of the body passed
+    size_t written = 0;
+    uint32_t lastProgress = millis();
+    while (written < size) {
+      size_t bytesWrite = _client->write(buff + written, size - written);
+      written += bytesWrite;
+      if (written == size) {
+        break;
+      }
+      uint32_t now = millis();
+      if (bytesWrite > 0) {
+        lastProgress = now;
+      }
 
-          // count bytes to read left
-          if (len > 0) {
-            len -= bytesRead;
-          }
+      GPT_LOGV(HTTP, "short write, %d of %d bytes written", written, size);
+      if (_client->getWriteError()) {
+        GPT_LOGD(HTTP, "stream write error %d", _client->getWriteError());
+        _client->clearWriteError();
+      }
+      if (!_client->connected()) {
+        GPT_LOGD(HTTP, "connection lost after %d of %d bytes", written, size);
+        return false;
+      }
 
-          delay(0);
-        } else {
-          delay(1);
+      uint32_t stalled = now - lastProgress;
+      if (stalled >= (uint32_t) _tcpTimeout) {
+        GPT_LOGD(HTTP, "write stalled after %d of %d bytes", written, size);
+        return false;
+      }
+      uint32_t wait = _tcpTimeout - stalled;
+      if (_bodyTimeout > 0) {
+        uint32_t elapsed = now - _bodyStart;
+        if (elapsed >= _bodyTimeout) {
+          GPT_LOGD(HTTP, "body timeout after %d of %d bytes", written, size);
+          return false;
+        }
+        if (_bodyTimeout - elapsed < wait) {
+          wait = _bodyTimeout - elapsed;
         }
       }
+      if (bytesWrite == 0) {
+        waitSocket(true, wait);
+      }
+    }
+    return true;
+  }
 
-      heap_caps_free(buff);
+  // Body bytes start after the room for the chunk header
+  inline uint8_t *bodyData() {
+    return _txBuffer + (_bodyChunked ? GPT_HTTP_CHUNK_HEADER_SIZE : 0);
+  }
 
-      log_v("connection closed or file end (written: %d).", bytesWritten);
+  inline size_t bodyCapacity() const {
+    return _txBufferSize - (_bodyChunked ? GPT_HTTP_CHUNK_HEADER_SIZE + GPT_HTTP_CHUNK_TRAILER_SIZE : 0);
+  }
 
-      if ((size > 0) && (size != bytesWritten)) {
-      log_d("bytesWritten %d and size %d mismatch!.", bytesWritten, size);
-      return HTTPC_ERROR_STREAM_WRITE;
-      }
+  /**
+  * send the buffered body bytes, framed as one chunk in chunked mode
+  * @return false after a send error
+  */
+  inline bool flushBody() {
+    if (_bodyFill == 0 || _bodyError != 0) {
+      return _bodyError == 0;
+    }
 
-    } else {
-      log_w("too less ram! need %d", buff_size);
-      return HTTPC_ERROR_TOO_LESS_RAM;
+    uint8_t *start = bodyData();
+    size_t length = _bodyFill;
+    if (_bodyChunked) {
+      char header[GPT_HTTP_CHUNK_HEADER_SIZE + 1];
+      int headerLength = snprintf(header, sizeof(header), "%X\r\n", (unsigned) _bodyFill);
+      start -= headerLength;
+      memcpy(start, header, headerLength);
+      memcpy(start + headerLength + _bodyFill, "\r\n", GPT_HTTP_CHUNK_TRAILER_SIZE);
+      length += headerLength + GPT_HTTP_CHUNK_TRAILER_SIZE;
     }
 
-    return bytesWritten;
+    if (!writeAll(start, length)) {
+      _bodyError = HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+      return false;
+    }
+    _bodySent += _bodyFill;
+    _bodyFill = 0;
+    return true;
+  }
+
+  /**
+  * wait until the socket is readable or writable
+  * @param write bool        wait for writability instead of readability
+  * @param timeout uint32_t  max time to wait in ms
+  * @return true if the socket is ready
+  */
+  inline bool waitSocket(bool write, uint32_t timeout) {
+    int fd = _client->fd();
+    if (fd < 0) {
+      return false;
+    }
+
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    return select(fd + 1, write ? nullptr : &set, write ? &set : nullptr, nullptr, &tv) > 0;
+  }
+
+  /**
+  * read what is available, blocking up to the TCP timeout for the first byte
+  * @param buff uint8_t *    destination
+  * @param size size_t       max bytes to read
+  * @return bytes read, 0 when nothing could be decoded yet, -1 on timeout
+  */
+  inline int readBlock(uint8_t *buff, size_t size) {
+    if (_client->available() <= 0 && !waitSocket(false, _tcpTimeout)) {
+      return -1;
+    }
+
+    int bytesRead = _client->read(buff, size);
+    return bytesRead > 0 ? bytesRead : 0;
+  }
+
+  inline uint8_t *txBuffer() {
+    if (!_txBuffer) {
+      _txBuffer = (uint8_t *) heap_caps_malloc(_txBufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
+    }
+    return _txBuffer;
   }
+
+  inline uint8_t *rxBuffer() {
+    if (!_rxBuffer) {
+      _rxBuffer = (uint8_t *) heap_caps_malloc(_rxBufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
+    }
+    return _rxBuffer;
+  }
+
+  // response headers the client reads itself, collected besides the caller's
+  static constexpr const char *TRANSPORT_HEADERS[] = {
+    "Content-Encoding",
+    "x-ratelimit-remaining-requests",
+    "x-ratelimit-remaining-tokens",
+    "x-ratelimit-reset-requests",
+    "x-ratelimit-reset-tokens",
+    "retry-after",
+  };
+
+  uint8_t *_txBuffer;
+  uint8_t *_rxBuffer;
+  size_t _txBufferSize;
+  size_t _rxBufferSize;
+
+  Body _body;
+  bool _bodyChunked;
+  size_t _bodySize;
+  size_t _bodyFill;
+  size_t _bodySent;
+  int _bodyError;
+  uint32_t _bodyStart; // the whole body is written within _bodyTimeout of this
+  uint32_t _bodyTimeout;
+
+  bool _acceptEncoding;
+  bool _collectsTransport;
+  int _keySlot; // gptKeys slot of the running request, -1 for the service key
+  size_t _compressedBytes;
+  size_t _decompressedBytes;
+
+  GPTSocketOptions _socketOptions;
+
+  SemaphoreHandle_t _lease;
+  uint32_t _lastUse;
+  std::atomic<uint32_t> _waiting; // requests blocked in acquire()
 };
 
-extern GPTWifiClient* gptWifiClient;
-extern GPTClient* gptHttp;
-extern WebSocketsClient* gptWebSocket;
\ No newline at end of file
+extern GPTLazy<GPTWifiClient> gptWifiClient;
+extern GPTLazy<GPTClient> gptHttp;
+#if GPT_ENABLE_WEBSOCKET
+extern GPTLazy<WebSocketsClient> gptWebSocket;
+#endif
\ No newline at end of file
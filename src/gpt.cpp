@@ -1,13 +1,17 @@
+#include "config.h"
+
+#if GPT_ENABLE_GPT
 #include "gpt.h"
 #include <WiFiClientSecure.h>
 #include <WiFi.h>
 #include "core.h"
+#include <esp_rom_crc.h>
 
 // Affordable GPT models sorted by cost (cheapest first)
 static const GPTModel AFFORDABLE_MODELS[] = {
 	{"gpt-5-nano", "GPT-5 Nano"},
 	{"gpt-4.1-nano", "GPT-4.1 Nano"},
-	{"gpt-4o-mini"},
+	{"gpt-4o-mini", "GPT-4o Mini"},
 	{"gpt-5-mini", "GPT-5 Mini"},
 	{"gpt-4.1-mini", "GPT-4.1 Mini"},
 	{"o3-mini", "O3 Mini"},
@@ -16,127 +20,477 @@ static const GPTModel AFFORDABLE_MODELS[] = {
 
 static const size_t NUM_AFFORDABLE_MODELS = sizeof(AFFORDABLE_MODELS) / sizeof(AFFORDABLE_MODELS[0]);
 
+// Stands in for the base64 media data until the payload is streamed
+static const char GPT_MEDIA_PLACEHOLDER[] = "{{gpt-media}}";
+
+// Asks the compaction model for a summary that can replace older turns
+static const char GPT_COMPACTION_INSTRUCTIONS[] =
+	"Summarize the conversation so far for your own later reference. Keep names, facts, "
+	"preferences, decisions and open questions; drop small talk. Write under 150 words "
+	"and reply with the summary only.";
+
+// Bytes read from a media file per step
+#ifndef GPT_MEDIA_CHUNK_SIZE
+#define GPT_MEDIA_CHUNK_SIZE 768
+#endif
+
+// Conversation state file: magic, version, length-prefixed fields, CRC32
+static const uint32_t GPT_STATE_MAGIC = 0x54535047; // "GPST"
+static const uint8_t GPT_STATE_VERSION = 1;
+
+// Larger state files are ignored
+#ifndef GPT_STATE_MAX_SIZE
+#define GPT_STATE_MAX_SIZE 16384
+#endif
+
+static void appendStateField(GPTString& record, std::string_view value) {
+	uint16_t length = value.size() < UINT16_MAX ? value.size() : UINT16_MAX;
+	record.append((const char*) &length, sizeof(length));
+	record.append(value.data(), length);
+}
+
+// Reads the fields back, fails once a field runs past the end
+struct GPTStateReader {
+	const char* pos;
+	const char* end;
+
+	bool readByte(uint8_t& value) {
+		if (pos >= end) {
+			return false;
+		}
+		value = (uint8_t) *pos++;
+		return true;
+	}
+
+	bool readField(String& value) {
+		uint16_t length;
+		if (end - pos < (ptrdiff_t) sizeof(length)) {
+			return false;
+		}
+		memcpy(&length, pos, sizeof(length));
+		pos += sizeof(length);
+		if (end - pos < length) {
+			return false;
+		}
+		value = String(pos, length);
+		pos += length;
+		return true;
+	}
+};
+
+struct GPTService::Request {
+	GPTService* service;
+	GPTArenaAllocator arena;
+	JsonDocument payload;
+	String prompt;
+	ResponseCallback callback;
+
+	// Media streamed into the payload, from memory, a file or a live source
+	enum MediaKind {
+		MEDIA_NONE,
+		MEDIA_IMAGE,
+		MEDIA_AUDIO
+	};
+	MediaKind mediaKind = MEDIA_NONE;
+	String mediaType; // MIME type of images, format of audio
+	const uint8_t* mediaData = nullptr;
+	size_t mediaSize = 0;
+	fs::FS* mediaFs = nullptr;
+	String mediaPath;
+	AudioFillCallback mediaFill;
+
+	bool hasMedia() const { return mediaKind != MEDIA_NONE; }
+
+	Request(GPTService* service, String&& prompt, ResponseCallback callback)
+		: service(service), payload(&arena), prompt(std::move(prompt)), callback(callback) {}
+};
+
+struct GPTService::CompactionJob {
+	GPTService* service;
+	uint32_t generation;
+	unsigned long until;
+	GPTArenaAllocator arena;
+	JsonDocument payload;
+
+	CompactionJob(GPTService* service, uint32_t generation)
+		: service(service), generation(generation), until(millis()), payload(&arena) {}
+};
+
 GPTService::GPTService()
 	: _model("gpt-5-nano")
+	, _audioModel("gpt-4o-mini-audio-preview")
 	, _systemMessage("Respond with thoughtful pauses (\"Hmm...\", \"Well...\") and be curious. Keep answers under 250 characters, playful, and supportive. Offer quick reflections, light humor, and gentle encouragement. Do not use any emoticons or emojis.")
 	, _initialized(false)
 	, _contextCache(10) // Keep last 10 messages
 	, _previousResponseId("") // Initialize empty for first conversation
 	, _storeResponse(true)
+	, _usage{}
+	, _lastTtfbMs(0)
+	, _compactModel("gpt-5-nano")
+	, _compactTokenBudget(0)
+	, _compactByteBudget(0)
+	, _lastInputTokens(0)
+	, _seedChain(false)
+	, _compacting(false)
+	, _summaryReady(false)
+	, _summaryUntil(0)
+	, _summaryGeneration(0)
+	, _conversationGeneration(0)
+	, _stateFs(nullptr)
+	, _stateDelay(GPT_STATE_WRITE_DELAY_MS)
+	, _stateRestored(false)
+	, _explicitConfig(0)
+	, _stateDirty(false)
+	, _stateLock(nullptr)
+	, _stateTask(nullptr)
 {
 }
 
 GPTService::~GPTService() {
-	// Clean up if needed
+	if (_stateTask != nullptr) {
+		vTaskDelete(_stateTask);
+		_stateTask = nullptr;
+	}
+	if (_stateLock != nullptr) {
+		vSemaphoreDelete(_stateLock);
+		_stateLock = nullptr;
+	}
 }
 
 bool GPTService::init(const String& apiKey) {
 	if (apiKey.length() == 0) {
-		ESP_LOGE("GPT", "API key is empty");
+		GPT_LOGE(GPT, "API key is empty");
 		return false;
 	}
 
 	_apiKey = apiKey;
 	_initialized = true;
 
-	ESP_LOGI("GPT", "GPT service initialized with model: %s", _model.c_str());
+	GPT_LOGI(GPT, "GPT service initialized with model: %s", _model.c_str());
 	return true;
 }
 
-String GPTService::buildJsonPayload(const String& userPrompt, const std::vector<std::pair<String, String>>& contextMessages) {
-	JsonDocument doc;
+void GPTService::buildJsonPayload(JsonDocument& doc, std::string_view userPrompt, const std::vector<std::pair<String, String>>& contextMessages, bool withImage) {
+	restoreState();
+	applyCompaction();
 
+	// Fields that stay the same from turn to turn come first, in a fixed
+	// order: the server only reuses a cached prompt for an identical prefix
 	doc["model"] = _model;
-	doc["input"] = userPrompt;
 	doc["instructions"] = _systemMessage;
-
 	JsonObject reasoning = doc["reasoning"].to<JsonObject>();
 	reasoning["effort"] = "low";
+	doc["store"] = _storeResponse; // store response to gpt
+	if (!_promptCacheKey.isEmpty()) {
+		doc["prompt_cache_key"] = _promptCacheKey;
+	}
 
 	// Include previous response ID for conversation continuity
 	if (_storeResponse && !_previousResponseId.isEmpty()) {
 		doc["previous_response_id"] = _previousResponseId;
 	}
 
-	doc["store"] = _storeResponse; // store response to gpt
-
-	String jsonString;
-	serializeJson(doc, jsonString);
-	return jsonString;
+	// A chain restarted after compaction begins with the summary and the turns after it
+	bool seed = _seedChain && _previousResponseId.isEmpty();
+	if (withImage || seed || !contextMessages.empty()) {
+		JsonArray input = doc["input"].to<JsonArray>();
+		if (seed) {
+			for (const ContextCache::Message& cached : _contextCache.getMessages()) {
+				JsonObject turn = input.add<JsonObject>();
+				turn["role"] = cached.role;
+				turn["content"] = cached.content;
+			}
+		}
+		for (const auto& context : contextMessages) {
+			JsonObject turn = input.add<JsonObject>();
+			turn["role"] = context.first;
+			turn["content"] = context.second;
+		}
+		JsonObject message = input.add<JsonObject>();
+		message["role"] = "user";
+		if (withImage) {
+			JsonArray content = message["content"].to<JsonArray>();
+			JsonObject text = content.add<JsonObject>();
+			text["type"] = "input_text";
+			text["text"] = userPrompt;
+			JsonObject image = content.add<JsonObject>();
+			image["type"] = "input_image";
+			image["image_url"] = GPT_MEDIA_PLACEHOLDER;
+		} else {
+			message["content"] = userPrompt;
+		}
+	} else {
+		doc["input"] = userPrompt;
+	}
 }
 
-void GPTService::sendPrompt(const String& prompt, ResponseCallback callback) {
-	sendPromptWithContext(prompt, {}, callback);
+void GPTService::sendPrompt(GPTText prompt, ResponseCallback callback) {
+	sendPromptWithContext(std::move(prompt), {}, callback);
 }
 
-void GPTService::sendPrompt(const String& prompt, const String& additionalContext, ResponseCallback callback) {
+void GPTService::sendPrompt(GPTText prompt, GPTText additionalContext, ResponseCallback callback) {
 	std::vector<std::pair<String, String>> contextMessages;
-	if (additionalContext.length() > 0) {
-		contextMessages.push_back({"system", additionalContext});
+	if (!additionalContext.isEmpty()) {
+		contextMessages.push_back({"system", additionalContext.release()});
 	}
-	sendPromptWithContext(prompt, contextMessages, callback);
+	sendPromptWithContext(std::move(prompt), contextMessages, callback);
 }
 
-void GPTService::sendPromptWithContext(const String& prompt,
+void GPTService::sendPromptWithContext(GPTText prompt,
 									  const std::vector<std::pair<String, String>>& contextMessages,
 									  ResponseCallback callback) {
+	// Build the JSON document straight from the caller's text, it is
+	// serialized into the connection by the request task
+	Request* request = new Request(this, prompt.release(), callback);
+	buildJsonPayload(request->payload, request->prompt.c_str(), contextMessages);
+	submit(request);
+}
+
+void GPTService::sendPromptWithImage(GPTText prompt, const uint8_t* image, size_t length, ResponseCallback callback, const char* mimeType) {
+	Request* request = new Request(this, prompt.release(), callback);
+	request->mediaKind = Request::MEDIA_IMAGE;
+	request->mediaType = mimeType;
+	request->mediaData = image;
+	request->mediaSize = length;
+	buildJsonPayload(request->payload, request->prompt.c_str(), {}, true);
+	submit(request);
+}
+
+void GPTService::sendPromptWithImage(GPTText prompt, fs::FS& fs, GPTText path, ResponseCallback callback, const char* mimeType) {
+	Request* request = new Request(this, prompt.release(), callback);
+	request->mediaKind = Request::MEDIA_IMAGE;
+	request->mediaType = mimeType;
+	request->mediaFs = &fs;
+	request->mediaPath = path.release();
+	buildJsonPayload(request->payload, request->prompt.c_str(), {}, true);
+	submit(request);
+}
+
+void GPTService::sendPromptWithAudio(GPTText prompt, const uint8_t* audio, size_t length, ResponseCallback callback, const char* format) {
+	Request* request = new Request(this, prompt.release(), callback);
+	request->mediaKind = Request::MEDIA_AUDIO;
+	request->mediaType = format;
+	request->mediaData = audio;
+	request->mediaSize = length;
+	buildAudioPayload(request->payload, request->prompt.c_str(), format);
+	submit(request);
+}
+
+void GPTService::sendPromptWithAudio(GPTText prompt, fs::FS& fs, GPTText path, ResponseCallback callback, const char* format) {
+	Request* request = new Request(this, prompt.release(), callback);
+	request->mediaKind = Request::MEDIA_AUDIO;
+	request->mediaType = format;
+	request->mediaFs = &fs;
+	request->mediaPath = path.release();
+	buildAudioPayload(request->payload, request->prompt.c_str(), format);
+	submit(request);
+}
+
+void GPTService::sendPromptWithAudio(GPTText prompt, AudioFillCallback fill, ResponseCallback callback, const char* format) {
+	Request* request = new Request(this, prompt.release(), callback);
+	request->mediaKind = Request::MEDIA_AUDIO;
+	request->mediaType = format;
+	request->mediaFill = fill;
+	buildAudioPayload(request->payload, request->prompt.c_str(), format);
+	submit(request);
+}
+
+void GPTService::buildAudioPayload(JsonDocument& doc, std::string_view userPrompt, const char* format) {
+	restoreState();
+	applyCompaction();
+
+	doc["model"] = _audioModel;
+	doc["modalities"][0] = "text";
+	if (!_promptCacheKey.isEmpty()) {
+		doc["prompt_cache_key"] = _promptCacheKey;
+	}
+
+	JsonArray messages = doc["messages"].to<JsonArray>();
+	JsonObject system = messages.add<JsonObject>();
+	system["role"] = "system";
+	system["content"] = _systemMessage;
+
+	// Chat Completions has no stored conversation, replay the recent turns
+	for (const ContextCache::Message& message : _contextCache.getRecentMessages()) {
+		JsonObject turn = messages.add<JsonObject>();
+		turn["role"] = message.role;
+		turn["content"] = message.content;
+	}
+
+	JsonObject message = messages.add<JsonObject>();
+	message["role"] = "user";
+	JsonArray content = message["content"].to<JsonArray>();
+	if (!userPrompt.empty()) {
+		JsonObject text = content.add<JsonObject>();
+		text["type"] = "text";
+		text["text"] = userPrompt;
+	}
+	JsonObject audio = content.add<JsonObject>();
+	audio["type"] = "input_audio";
+	audio["input_audio"]["data"] = GPT_MEDIA_PLACEHOLDER;
+	audio["input_audio"]["format"] = format;
+}
+
+void GPTService::submit(Request* request) {
 	if (!_initialized) {
-		ESP_LOGE("GPT", "GPT service not initialized");
-		callback(prompt, "Error: GPT service not initialized");
+		GPT_LOGE(GPT, "GPT service not initialized");
+		request->callback(request->prompt, "Error: GPT service not initialized");
+		delete request;
 		return;
 	}
 
 	if (!WiFi.isConnected()) {
-		ESP_LOGE("GPT", "No WiFi connection");
-		callback(prompt, "Error: No internet connection");
+		GPT_LOGE(GPT, "No WiFi connection");
+		request->callback(request->prompt, "Error: No internet connection");
+		delete request;
 		return;
 	}
 
 	// Add user message to context cache
-	_contextCache.addMessage("user", prompt);
-
-	// Build JSON payload
-	String jsonPayload = buildJsonPayload(prompt, contextMessages);
+	_contextCache.addMessage("user", request->mediaKind == Request::MEDIA_AUDIO && request->prompt.isEmpty() ? String("(spoken message)") : request->prompt);
 
 	// Create async task for HTTP request (since GPT API calls are slow)
 	xTaskCreatePinnedToCore([](void* param) {
-		auto* params = static_cast<std::tuple<GPTService*, String, ResponseCallback>*>(param);
-		auto& [service, payload, cb] = *params;
+		Request* request = static_cast<Request*>(param);
+		GPTService* service = request->service;
+		ResponseCallback& cb = request->callback;
 
+		gptHttp->acquire(); // wait for the request of another service to finish
 		gptWifiClient->setInsecure(); // For HTTPS without certificate validation
-		gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/responses");
-		gptHttp->setReuse(false);
+		// Audio input is only available through Chat Completions
+		if (request->mediaKind == Request::MEDIA_AUDIO) {
+			gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/chat/completions");
+		} else {
+			gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/responses");
+		}
+		gptHttp->setReuse(true); // the reply is read by length, keep the TLS session
 		gptHttp->addHeader("Content-Type", "application/json");
-		gptHttp->addHeader("Authorization", "Bearer " + service->_apiKey);
+		gptHttp->addAuthorization(service->_apiKey); // next key of gptKeys, if any
 		gptHttp->setTimeout(30000); // 30 second timeout
+		// small requests are latency bound, media uploads throughput bound
+		gptHttp->setTransportProfile(request->hasMedia() ? GPTTransportProfile::GPT_BULK : GPTTransportProfile::GPT_INTERACTIVE);
+		gptHttp->setAcceptEncoding(true); // JSON replies compress well
 
-		ESP_LOGI("GPT", "Sending request to OpenAI API...");
+		GPT_LOGD(GPT, "Sending request to OpenAI API...");
 
-		int httpCode = gptHttp->POST(payload);
+		// Returns once the response headers arrived
+		uint32_t start = millis();
+		int httpCode = request->hasMedia() ? sendMediaRequest(request) : gptHttp->sendJson("POST", request->payload);
+		service->_lastTtfbMs = millis() - start;
 
+		GPTString response;
 		if (httpCode > 0) {
-			String response = gptHttp->getString();
-			ESP_LOGI("GPT", "API response received, code: %d", httpCode);
-			service->processResponse(httpCode, response, payload, cb);
-		} else {
-			ESP_LOGE("GPT", "HTTP request failed, error: %d", httpCode);
-			cb(payload, "Error: Failed to connect to GPT API");
+			gptHttp->getBody(response);
 		}
 
+		// Free the connection before any user code runs, a callback may
+		// start the next request
 		gptHttp->end();
-		delete params;
-		params = nullptr;
+		gptHttp->release();
+
+		if (httpCode > 0) {
+			GPT_LOGD(GPT, "API response received, code: %d", httpCode);
+
+			// The response reuses the slab of the sent payload
+			request->payload.clear();
+			request->arena.reset();
+			service->processResponse(httpCode, response, request->prompt, cb, &request->arena);
+		} else {
+			GPT_LOGE(GPT, "HTTP request failed, error: %d", httpCode);
+			cb(request->prompt, "Error: Failed to connect to GPT API");
+		}
+
+		delete request;
+		request = nullptr;
 		vTaskDelete(NULL);
-	}, "GPT_Request", 8192, new std::tuple<GPTService*, String, ResponseCallback>(this, jsonPayload, callback), 1, NULL, 1);
+	}, "GPT_Request", 8192, request, 1, NULL, 1);
 }
 
-void GPTService::processResponse(int httpCode, const String& response, const String& userPrompt, ResponseCallback callback) {
+int GPTService::sendMediaRequest(Request* request) {
+	// The JSON around the media is small: serialize it and split it at the
+	// placeholder, the media itself is encoded straight into the body.
+	// Live sources have no known size and are sent chunked.
+	GPTString json;
+	json.reserve(measureJson(request->payload));
+	serializeJson(request->payload, json);
+
+	// The media field is written after every prompt and context string, so
+	// the last match is the placeholder even if a prompt contains its text
+	size_t placeholderLength = sizeof(GPT_MEDIA_PLACEHOLDER) - 1;
+	size_t prefixLength = std::string_view(json.c_str(), json.length()).rfind(GPT_MEDIA_PLACEHOLDER, std::string_view::npos, placeholderLength);
+	if (prefixLength == std::string_view::npos) {
+		return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+	}
+
+	File file;
+	size_t mediaSize = request->mediaSize;
+	if (request->mediaFs != nullptr) {
+		file = request->mediaFs->open(request->mediaPath, "r");
+		if (!file) {
+			GPT_LOGE(GPT, "Failed to open media file: %s", request->mediaPath.c_str());
+			return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+		}
+		mediaSize = file.size();
+	}
+
+	// Images go in as a data URL, audio as plain base64
+	String dataUrl;
+	if (request->mediaKind == Request::MEDIA_IMAGE) {
+		dataUrl = "data:" + request->mediaType + ";base64,";
+	}
+
+	bool live = request->mediaFill != nullptr;
+	size_t length = 0;
+	if (!live) {
+		length = json.length() - placeholderLength + dataUrl.length() + GPTBase64Encoder::encodedLength(mediaSize);
+		GPT_LOGI(GPT, "Streaming %u bytes of %s (%u byte body)", mediaSize, request->mediaType.c_str(), length);
+	} else {
+		GPT_LOGI(GPT, "Streaming live %s", request->mediaType.c_str());
+	}
+
+	int ret = gptHttp->beginBody("POST", length);
+	if (ret < 0) {
+		return ret;
+	}
+
+	gptHttp->writeBody((const uint8_t*) json.c_str(), prefixLength);
+	gptHttp->writeBody((const uint8_t*) dataUrl.c_str(), dataUrl.length());
+
+	GPTBase64Encoder encoder(gptHttp->body());
+	if (file) {
+		uint8_t chunk[GPT_MEDIA_CHUNK_SIZE];
+		size_t remaining = mediaSize;
+		while (remaining > 0) {
+			size_t bytes = file.read(chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+			if (bytes == 0) {
+				break;
+			}
+			encoder.write(chunk, bytes);
+			remaining -= bytes;
+		}
+		file.close();
+	} else if (live) {
+		uint8_t chunk[GPT_MEDIA_CHUNK_SIZE];
+		size_t bytes;
+		while ((bytes = request->mediaFill(chunk, sizeof(chunk))) > 0) {
+			encoder.write(chunk, bytes);
+		}
+	} else {
+		encoder.write(request->mediaData, request->mediaSize);
+	}
+	encoder.finish();
+
+	gptHttp->writeBody((const uint8_t*) json.c_str() + prefixLength + placeholderLength, json.length() - prefixLength - placeholderLength);
+	return gptHttp->endBody();
+}
+
+void GPTService::processResponse(int httpCode, const GPTString& response, const String& userPrompt, ResponseCallback callback, ArduinoJson::Allocator* allocator) {
 	if (httpCode != 200) {
-		ESP_LOGE("GPT", "API returned error code: %d", httpCode);
+		GPT_LOGE(GPT, "API returned error code: %d", httpCode);
 
 		// Try to extract error message from JSON
-		JsonDocument errorDoc;
-		if (deserializeJson(errorDoc, response) == DeserializationError::Ok) {
+		JsonDocument errorDoc(allocator);
+		if (deserializeJson(errorDoc, response.c_str(), response.length()) == DeserializationError::Ok) {
 			if (errorDoc["error"].is<JsonObject>()) {
 				String errorMsg = errorDoc["error"]["message"] | "Unknown API error";
 				callback(userPrompt, "Error: " + errorMsg);
@@ -149,77 +503,463 @@ void GPTService::processResponse(int httpCode, const String& response, const Str
 	}
 
 	// Parse successful response
-	String gptResponse = extractResponse(response);
+	String gptResponse = extractResponse(response.view(), allocator);
 	if (gptResponse.length() > 0) {
 		// Add assistant response to context cache
 		_contextCache.addMessage("assistant", gptResponse);
+		saveState();
+		checkCompaction();
 
-		ESP_LOGI("GPT", "Response generated successfully (%d chars)", gptResponse.length());
+		GPT_LOGI(GPT, "Response generated successfully (%d chars)", gptResponse.length());
 		callback(userPrompt, gptResponse);
 	} else {
-		ESP_LOGE("GPT", "Failed to extract response from API reply");
+		GPT_LOGE(GPT, "Failed to extract response from API reply");
 		callback(userPrompt, "Error: Could not parse GPT response");
 	}
 }
 
-String GPTService::extractResponse(const String& jsonResponse) {
-	JsonDocument doc;
+String GPTService::extractResponse(std::string_view jsonResponse, ArduinoJson::Allocator* allocator, bool continueChain) {
+	JsonDocument doc(allocator);
 
-	DeserializationError error = deserializeJson(doc, jsonResponse);
+	DeserializationError error = deserializeJson(doc, jsonResponse.data(), jsonResponse.size());
 	if (error) {
-		ESP_LOGE("GPT", "JSON parse error: %s", error.c_str());
+		GPT_LOGE(GPT, "JSON parse error: %s", error.c_str());
 		return "";
 	}
 
+	if (continueChain) {
+		recordUsage(doc["usage"]);
+	}
+
+	// Chat Completions format, used for audio prompts. Its id does not
+	// continue a Responses conversation and is not stored.
+	if (doc["choices"].is<JsonArray>()) {
+		String content = doc["choices"][0]["message"]["content"] | "";
+		content.trim();
+		if (content.length() == 0) {
+			GPT_LOGE(GPT, "No content in chat completion");
+		} else if (continueChain && _storeResponse) {
+			// The stored chain misses this turn, the next text prompt starts
+			// a new chain seeded with the cached history
+			_previousResponseId = "";
+			_seedChain = true;
+		}
+		return content;
+	}
+
 	// Extract and store response ID for conversation continuity
-	if (_storeResponse && doc["id"].is<String>()) {
+	if (continueChain && _storeResponse && doc["id"].is<String>()) {
 		_previousResponseId = doc["id"].as<String>();
+		_seedChain = false;
 	}
 
 	// Navigate to the response content (Responses API format)
 	if (!doc["output"].is<JsonArray>() || doc["output"].size() == 0) {
-		ESP_LOGE("GPT", "No output in response. response: %s", doc.as<String>().c_str());
+		GPT_LOG_JSON(ERROR, GPT, "No output in response", doc);
 		return "";
 	}
 
-	JsonDocument outputItem;
-	for(auto outputI : doc["output"].as<JsonArray>()){
+	JsonObject outputItem;
+	for(JsonObject outputI : doc["output"].as<JsonArray>()){
 		if(outputI["type"] == "message") {
-			outputItem.set(outputI);
-			ESP_LOGI("GPT", "Found message in output item. message: %s", outputI.as<String>().c_str());
+			outputItem = outputI;
+			GPT_LOG_JSON(DEBUG, GPT, "Found message in output item", outputI);
 			break;
 		}
 	}
 
 	if (!outputItem["content"].is<JsonArray>() || outputItem["content"].size() == 0) {
-		ESP_LOGE("GPT", "No content in output item. response: %s", doc.as<String>().c_str());
+		GPT_LOG_JSON(ERROR, GPT, "No content in output item", doc);
 		return "";
 	}
 
 	JsonObject contentItem = outputItem["content"][0];
 	if (!contentItem["text"].is<String>()) {
-		ESP_LOGE("GPT", "No text in content item. response: %s", doc.as<String>().c_str());
+		GPT_LOG_JSON(ERROR, GPT, "No text in content item", doc);
 		return "";
 	}
 
 	String content = contentItem["text"];
 	content.trim(); // Remove any leading/trailing whitespace
 	if (content.length() == 0) {
-		ESP_LOGE("GPT", "Empty content in response. response: %s", doc.as<String>().c_str());
+		GPT_LOG_JSON(ERROR, GPT, "Empty content in response", doc);
 		return "";
 	};
 
 	return content;
 }
 
+void GPTService::recordUsage(JsonVariantConst usage) {
+	if (!usage.is<JsonObjectConst>()) {
+		return;
+	}
+
+	// Responses names them input / output, Chat Completions prompt / completion
+	uint32_t input = usage["input_tokens"] | usage["prompt_tokens"] | 0;
+	uint32_t cached = usage["input_tokens_details"]["cached_tokens"] | usage["prompt_tokens_details"]["cached_tokens"] | 0;
+	uint32_t output = usage["output_tokens"] | usage["completion_tokens"] | 0;
+	_lastInputTokens = input;
+
+	portENTER_CRITICAL(&_usageLock);
+	_usage.requests++;
+	_usage.inputTokens += input;
+	_usage.cachedTokens += cached;
+	_usage.outputTokens += output;
+	_usage.lastInputTokens = input;
+	_usage.lastCachedTokens = cached;
+	_usage.lastTtfbMs = _lastTtfbMs;
+	if (cached > 0) {
+		_usage.cachedRequests++;
+		_usage.totalTtfbCachedMs += _lastTtfbMs;
+	} else {
+		_usage.totalTtfbUncachedMs += _lastTtfbMs;
+	}
+	portEXIT_CRITICAL(&_usageLock);
+
+	GPT_LOGD(GPT, "Usage: %u input (%u cached), %u output tokens, %u ms to headers", input, cached, output, _lastTtfbMs);
+}
+
+GPTService::UsageStats GPTService::getUsageStats() const {
+	portENTER_CRITICAL(&_usageLock);
+	UsageStats stats = _usage;
+	portEXIT_CRITICAL(&_usageLock);
+	return stats;
+}
+
+void GPTService::resetUsageStats() {
+	portENTER_CRITICAL(&_usageLock);
+	_usage = UsageStats{};
+	portEXIT_CRITICAL(&_usageLock);
+}
+
 std::vector<GPTModel> GPTService::getAvailableModels() {
-	return std::vector<GPTModel>(AFFORDABLE_MODELS, AFFORDABLE_MODELS + NUM_AFFORDABLE_MODELS);
+	return gptCatalog->getModels(GPTModelCatalog::GPT_CATALOG_TEXT, AFFORDABLE_MODELS, NUM_AFFORDABLE_MODELS);
 }
 
 void GPTService::resetConversation() {
 	_previousResponseId = "";
 	_contextCache.clear();
-	ESP_LOGI("GPT", "Conversation state reset");
+	_seedChain = false;
+	_lastInputTokens = 0;
+	_conversationGeneration++; // a summary still being written is dropped
+	if (_summaryReady.exchange(false)) {
+		_compacting = false;
+	}
+	if (_stateLock != nullptr) {
+		xSemaphoreTake(_stateLock, portMAX_DELAY);
+		_stateRestored = true; // the stored conversation is discarded as well
+		xSemaphoreGive(_stateLock);
+	}
+	saveState();
+	GPT_LOGI(GPT, "Conversation state reset");
+}
+
+void GPTService::checkCompaction() {
+	bool overTokens = _compactTokenBudget > 0 && _lastInputTokens > _compactTokenBudget;
+	bool overBytes = _compactByteBudget > 0 && _contextCache.getContentLength() > _compactByteBudget;
+	if (!(overTokens || overBytes) || _compacting.exchange(true)) {
+		return;
+	}
+
+	GPT_LOGI(GPT, "Conversation over budget (%u input tokens, %u cached bytes), compacting",
+		_lastInputTokens, _contextCache.getContentLength());
+
+	CompactionJob* job = new CompactionJob(this, _conversationGeneration);
+	JsonDocument& doc = job->payload;
+	doc["model"] = _compactModel;
+	doc["instructions"] = GPT_COMPACTION_INSTRUCTIONS;
+	if (_storeResponse && !_previousResponseId.isEmpty()) {
+		// The server holds the whole chain, including turns no longer cached
+		doc["previous_response_id"] = _previousResponseId;
+		doc["input"] = "Summarize our conversation so far.";
+	} else {
+		GPTString transcript;
+		for (const ContextCache::Message& message : _contextCache.getMessages()) {
+			transcript.append(message.role);
+			transcript.append(": ");
+			transcript.append(message.content);
+			transcript.append('\n');
+		}
+		doc["input"] = transcript.view();
+	}
+	doc["reasoning"]["effort"] = "low";
+	doc["store"] = false;
+
+	// Runs between turns and only takes the connection while no prompt waits
+	// for it; a prompt sent during the summary request waits for that one
+	xTaskCreatePinnedToCore([](void* param) {
+		CompactionJob* job = static_cast<CompactionJob*>(param);
+		GPTService* service = job->service;
+
+		gptHttp->acquireIdle(); // let live requests of every service go first
+		gptWifiClient->setInsecure(); // For HTTPS without certificate validation
+		gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/responses");
+		gptHttp->setReuse(true);
+		gptHttp->addHeader("Content-Type", "application/json");
+		gptHttp->addAuthorization(service->_apiKey); // next key of gptKeys, if any
+		gptHttp->setTimeout(30000); // 30 second timeout
+		gptHttp->setTransportProfile(GPTTransportProfile::GPT_BULK); // background, not latency bound
+		gptHttp->setAcceptEncoding(true);
+
+		String summary;
+		int httpCode = gptHttp->sendJson("POST", job->payload);
+		if (httpCode > 0) {
+			GPTString response;
+			gptHttp->getBody(response);
+			if (httpCode == 200) {
+				job->payload.clear();
+				job->arena.reset();
+				summary = service->extractResponse(response.view(), &job->arena, false);
+			}
+		}
+		gptHttp->end();
+		gptHttp->release();
+
+		// A reset after this check is caught by applyCompaction()
+		if (summary.length() > 0 && job->generation == service->_conversationGeneration) {
+			service->_summary = std::move(summary);
+			service->_summaryUntil = job->until;
+			service->_summaryGeneration = job->generation;
+			service->_summaryReady = true; // applied when the next prompt is built
+		} else {
+			GPT_LOGW(GPT, "Compaction failed or discarded, code: %d", httpCode);
+			service->_compacting = false;
+		}
+
+		delete job;
+		vTaskDelete(NULL);
+	}, "GPT_Compact", 8192, job, 1, NULL, 1);
+}
+
+void GPTService::applyCompaction() {
+	if (!_summaryReady) {
+		return;
+	}
+
+	// Published for a conversation that was reset in the meantime
+	if (_summaryGeneration != _conversationGeneration) {
+		_summary = String();
+		_summaryReady = false;
+		_compacting = false;
+		GPT_LOGD(GPT, "Discarding summary of a reset conversation");
+		return;
+	}
+
+	size_t before = _contextCache.getContentLength();
+	_contextCache.compact(_summaryUntil, "Summary of the earlier conversation: " + _summary);
+	_summary = String();
+	if (_storeResponse) {
+		// Continue on a fresh chain instead of the grown one
+		_previousResponseId = "";
+		_seedChain = true;
+	}
+	_lastInputTokens = 0;
+	_summaryReady = false;
+	_compacting = false;
+
+	GPT_LOGI(GPT, "Conversation compacted, cached history %u -> %u bytes", before, _contextCache.getContentLength());
+	saveState();
+}
+
+void GPTService::enablePersistence(fs::FS& fs, GPTText path, uint32_t delayMs) {
+	if (_stateLock == nullptr) {
+		_stateLock = xSemaphoreCreateMutex();
+	}
+	xSemaphoreTake(_stateLock, portMAX_DELAY);
+	_stateFs = &fs;
+	_statePath = path.release();
+	_stateDelay = delayMs;
+	_stateRestored = false;
+	xSemaphoreGive(_stateLock);
+}
+
+bool GPTService::flushState() {
+	return _stateFs == nullptr || writeState();
+}
+
+void GPTService::configChanged(ConfigField field) {
+	_explicitConfig |= field;
+	saveState();
+}
+
+void GPTService::restoreState() {
+	if (_stateFs == nullptr) {
+		return;
+	}
+
+	// Runs on the caller's task and on request tasks
+	xSemaphoreTake(_stateLock, portMAX_DELAY);
+	restoreStateLocked();
+	xSemaphoreGive(_stateLock);
+}
+
+void GPTService::restoreStateLocked() {
+	if (_stateRestored) {
+		return;
+	}
+	_stateRestored = true;
+
+	// Without the state file a write was cut off before the swap
+	String path = _statePath;
+	if (!_stateFs->exists(path)) {
+		path += ".tmp";
+	}
+	if (!_stateFs->exists(path)) {
+		return;
+	}
+	File file = _stateFs->open(path, "r");
+	if (!file) {
+		return;
+	}
+	size_t size = file.size();
+	GPTString record;
+	if (size > GPT_STATE_MAX_SIZE || size < sizeof(uint32_t) * 2 + 1 || !record.reserve(size)) {
+		GPT_LOGW(GPT, "Ignoring state file %s (%u bytes)", _statePath.c_str(), size);
+		file.close();
+		return;
+	}
+	size_t bytesRead = file.read((uint8_t*) record.data(), size);
+	file.close();
+
+	// Check magic, version and CRC before touching the current state
+	const char* data = record.data();
+	uint32_t magic;
+	uint32_t crc;
+	memcpy(&magic, data, sizeof(magic));
+	memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+	if (bytesRead != size || magic != GPT_STATE_MAGIC || (uint8_t) data[sizeof(magic)] != GPT_STATE_VERSION
+		|| esp_rom_crc32_le(0, (const uint8_t*) data, size - sizeof(crc)) != crc) {
+		GPT_LOGW(GPT, "State file %s is invalid, starting a new conversation", _statePath.c_str());
+		return;
+	}
+
+	GPTStateReader reader = {data + sizeof(magic) + 1, data + size - sizeof(crc)};
+	String responseId, model, audioModel, systemMessage;
+	uint8_t storeResponse, count;
+	if (!reader.readField(responseId) || !reader.readByte(storeResponse) || !reader.readField(model)
+		|| !reader.readField(audioModel) || !reader.readField(systemMessage) || !reader.readByte(count)) {
+		GPT_LOGW(GPT, "State file %s is truncated", _statePath.c_str());
+		return;
+	}
+
+	std::vector<std::pair<String, String>> messages;
+	messages.reserve(count);
+	for (uint8_t i = 0; i < count; i++) {
+		String role, content;
+		if (!reader.readField(role) || !reader.readField(content)) {
+			GPT_LOGW(GPT, "State file %s is truncated", _statePath.c_str());
+			return;
+		}
+		messages.push_back({std::move(role), std::move(content)});
+	}
+
+	_previousResponseId = std::move(responseId);
+	_storeResponse = storeResponse != 0;
+	if (!(_explicitConfig & CONFIG_MODEL)) {
+		_model = std::move(model);
+	}
+	if (!(_explicitConfig & CONFIG_AUDIO_MODEL)) {
+		_audioModel = std::move(audioModel);
+	}
+	if (!(_explicitConfig & CONFIG_SYSTEM_MESSAGE)) {
+		_systemMessage = std::move(systemMessage);
+	}
+	_contextCache.clear();
+	for (auto& message : messages) {
+		_contextCache.addMessage(message.first, std::move(message.second));
+	}
+	// A chain dropped by compaction restarts from the restored history
+	_seedChain = _storeResponse && _previousResponseId.isEmpty() && count > 0;
+
+	GPT_LOGI(GPT, "Restored conversation state (%u messages, %s)", count,
+		_previousResponseId.isEmpty() ? "no response ID" : _previousResponseId.c_str());
 }
 
-GPTService ai;
\ No newline at end of file
+void GPTService::saveState() {
+	if (_stateFs == nullptr) {
+		return;
+	}
+
+	xSemaphoreTake(_stateLock, portMAX_DELAY);
+
+	// Never replace a stored conversation that was not read yet
+	restoreStateLocked();
+
+	// Snapshot on the calling task, the state task only writes the bytes
+	const std::vector<ContextCache::Message>& messages = _contextCache.getMessages();
+	uint8_t count = messages.size() < UINT8_MAX ? messages.size() : UINT8_MAX;
+	GPTString record;
+	record.append((const char*) &GPT_STATE_MAGIC, sizeof(GPT_STATE_MAGIC));
+	record.append((char) GPT_STATE_VERSION);
+	appendStateField(record, std::string_view(_previousResponseId.c_str(), _previousResponseId.length()));
+	record.append((char) _storeResponse);
+	appendStateField(record, std::string_view(_model.c_str(), _model.length()));
+	appendStateField(record, std::string_view(_audioModel.c_str(), _audioModel.length()));
+	appendStateField(record, std::string_view(_systemMessage.c_str(), _systemMessage.length()));
+	record.append((char) count);
+	for (size_t i = messages.size() - count; i < messages.size(); i++) {
+		appendStateField(record, std::string_view(messages[i].role.c_str(), messages[i].role.length()));
+		appendStateField(record, std::string_view(messages[i].content.c_str(), messages[i].content.length()));
+	}
+	uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*) record.c_str(), record.length());
+	record.append((const char*) &crc, sizeof(crc));
+
+	_stateRecord = std::move(record);
+	_stateDirty = true;
+
+	if (_stateTask == nullptr) {
+		xTaskCreatePinnedToCore([](void* param) {
+			static_cast<GPTService*>(param)->stateTask();
+		}, "GPT_State", 4096, this, 1, &_stateTask, 0);
+	}
+	TaskHandle_t task = _stateTask;
+	xSemaphoreGive(_stateLock);
+
+	if (task != nullptr) {
+		xTaskNotifyGive(task);
+	}
+}
+
+bool GPTService::writeState() {
+	xSemaphoreTake(_stateLock, portMAX_DELAY);
+	if (!_stateDirty) {
+		xSemaphoreGive(_stateLock);
+		return true;
+	}
+
+	// Write a temporary file and swap it in, a power loss keeps the old state
+	String tempPath = _statePath + ".tmp";
+	File file = _stateFs->open(tempPath, "w");
+	bool ok = file && file.write((const uint8_t*) _stateRecord.c_str(), _stateRecord.length()) == _stateRecord.length();
+	if (file) {
+		file.close();
+	}
+	if (ok) {
+		_stateFs->remove(_statePath);
+		ok = _stateFs->rename(tempPath, _statePath);
+	}
+	if (ok) {
+		_stateDirty = false;
+		GPT_LOGD(GPT, "Conversation state written (%u bytes)", _stateRecord.length());
+	} else {
+		GPT_LOGE(GPT, "Failed to write state file %s", _statePath.c_str());
+	}
+	xSemaphoreGive(_stateLock);
+	return ok;
+}
+
+void GPTService::stateTask() {
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		// Coalesce changes until they settle, but write at least every few delays
+		uint32_t start = millis();
+		while (millis() - start < _stateDelay * 4 && ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_stateDelay)) > 0) {
+		}
+		writeState();
+	}
+}
+
+GPTService ai;
+
+#endif // GPT_ENABLE_GPT
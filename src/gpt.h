@@ -1,11 +1,26 @@
 #ifndef GPT_SERVICE_H
 #define GPT_SERVICE_H
 
+#include "config.h"
+
+#if !GPT_ENABLE_GPT
+#error "gpt.h is included but the service is disabled, see GPT_ENABLE_GPT"
+#endif
+
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <functional>
+#include <string_view>
 #include <vector>
+#include <FS.h>
+#include <atomic>
+#include "core.h"
+
+// Time without further changes before the conversation state is written
+#ifndef GPT_STATE_WRITE_DELAY_MS
+#define GPT_STATE_WRITE_DELAY_MS 5000
+#endif
 
 struct GPTModel {
 	const char* id;
@@ -25,9 +40,9 @@ public:
 
 	ContextCache(size_t maxMessages = 10) : _maxMessages(maxMessages) {}
 
-	void addMessage(const String& role, const String& content) {
-		Message msg = {role, content, millis()};
-		_messages.push_back(msg);
+	void addMessage(const String& role, String content) {
+		Message msg = {role, std::move(content), millis()};
+		_messages.push_back(std::move(msg));
 
 		// Keep only recent messages
 		if (_messages.size() > _maxMessages) {
@@ -44,6 +59,31 @@ public:
 		return std::vector<Message>(_messages.end() - count, _messages.end());
 	}
 
+	const std::vector<Message>& getMessages() const {
+		return _messages;
+	}
+
+	// Bytes of message content held
+	size_t getContentLength() const {
+		size_t length = 0;
+		for (const Message& msg : _messages) {
+			length += msg.content.length();
+		}
+		return length;
+	}
+
+	// Replace the messages added up to a point in time with a summary
+	void compact(unsigned long until, String summary) {
+		std::vector<Message> messages;
+		messages.push_back({"system", std::move(summary), until});
+		for (Message& msg : _messages) {
+			if ((long) (msg.timestamp - until) > 0) {
+				messages.push_back(std::move(msg));
+			}
+		}
+		_messages = std::move(messages);
+	}
+
 	void clear() {
 		_messages.clear();
 	}
@@ -55,9 +95,26 @@ private:
 
 class GPTService {
 public:
+	// Token usage reported by the API and time to the response headers
+	struct UsageStats {
+		uint32_t requests;            // replies that reported usage
+		uint32_t cachedRequests;      // replies that reused a cached prompt prefix
+		uint32_t inputTokens;
+		uint32_t cachedTokens;        // input tokens served from the prompt cache
+		uint32_t outputTokens;
+		uint32_t lastInputTokens;
+		uint32_t lastCachedTokens;
+		uint32_t lastTtfbMs;          // request start until response headers
+		uint32_t totalTtfbCachedMs;   // average = totalTtfbCachedMs / cachedRequests
+		uint32_t totalTtfbUncachedMs; // average = totalTtfbUncachedMs / (requests - cachedRequests)
+	};
+
 	// Callback type for GPT responses
 	using ResponseCallback = std::function<void(const String& payload, const String& response)>;
 
+	// Fills buffer with up to size bytes of a live audio clip, 0 ends the clip
+	using AudioFillCallback = std::function<size_t(uint8_t* buffer, size_t size)>;
+
 	GPTService();
 	~GPTService();
 
@@ -76,10 +133,10 @@ public:
 
 	/**
 	 * Send a prompt to GPT
-	 * @param prompt User prompt
+	 * @param prompt User prompt (literal, view or String; rvalue Strings are moved)
 	 * @param callback Response callback
 	 */
-	void sendPrompt(const String& prompt, ResponseCallback callback);
+	void sendPrompt(GPTText prompt, ResponseCallback callback);
 
 	/**
 	 * Send prompt with additional context
@@ -87,7 +144,7 @@ public:
 	 * @param additionalContext Extra context information
 	 * @param callback Response callback
 	 */
-	void sendPrompt(const String& prompt, const String& additionalContext, ResponseCallback callback);
+	void sendPrompt(GPTText prompt, GPTText additionalContext, ResponseCallback callback);
 
 	/**
 	 * Send prompt with structured context messages
@@ -95,24 +152,141 @@ public:
 	 * @param contextMessages Vector of role-content pairs
 	 * @param callback Response callback
 	 */
-	void sendPromptWithContext(const String& prompt,
+	void sendPromptWithContext(GPTText prompt,
 							  const std::vector<std::pair<String, String>>& contextMessages,
 							  ResponseCallback callback);
 
+	/**
+	 * Send a prompt together with an encoded image, e.g. an ESP32-CAM frame.
+	 * The image is base64 encoded straight into the request body.
+	 * @param prompt User prompt
+	 * @param image Image bytes, must stay valid until the callback ran
+	 * @param length Image size in bytes
+	 * @param callback Response callback
+	 * @param mimeType Image type
+	 */
+	void sendPromptWithImage(GPTText prompt, const uint8_t* image, size_t length, ResponseCallback callback, const char* mimeType = "image/jpeg");
+
+	/**
+	 * Send a prompt together with an image file
+	 * @param prompt User prompt
+	 * @param fs Filesystem holding the image
+	 * @param path Path of the image file
+	 * @param callback Response callback
+	 * @param mimeType Image type
+	 */
+	void sendPromptWithImage(GPTText prompt, fs::FS& fs, GPTText path, ResponseCallback callback, const char* mimeType = "image/jpeg");
+
+	/**
+	 * Send a spoken prompt in one request, without a separate transcription.
+	 * Uses the audio model through the Chat Completions API; the audio is
+	 * base64 encoded straight into the request body. The stored Responses
+	 * chain does not see the turn, the next text prompt starts a new chain
+	 * from the context cache.
+	 * @param prompt Optional text sent along with the audio, may be empty
+	 * @param audio Encoded clip, must stay valid until the callback ran
+	 * @param length Clip size in bytes
+	 * @param callback Response callback
+	 * @param format Audio format, "wav" or "mp3"
+	 */
+	void sendPromptWithAudio(GPTText prompt, const uint8_t* audio, size_t length, ResponseCallback callback, const char* format = "wav");
+
+	/**
+	 * Send a spoken prompt from an audio file
+	 * @param prompt Optional text sent along with the audio, may be empty
+	 * @param fs Filesystem holding the clip
+	 * @param path Path of the audio file
+	 * @param callback Response callback
+	 * @param format Audio format, "wav" or "mp3"
+	 */
+	void sendPromptWithAudio(GPTText prompt, fs::FS& fs, GPTText path, ResponseCallback callback, const char* format = "wav");
+
+	/**
+	 * Send a spoken prompt produced while the request is sent, e.g. from a
+	 * microphone. The fill callback runs on the request task and must
+	 * deliver a complete clip in the given format; the body is sent with
+	 * chunked transfer encoding.
+	 * @param prompt Optional text sent along with the audio, may be empty
+	 * @param fill Audio source, returns 0 at the end of the clip
+	 * @param callback Response callback
+	 * @param format Audio format, "wav" or "mp3"
+	 */
+	void sendPromptWithAudio(GPTText prompt, AudioFillCallback fill, ResponseCallback callback, const char* format = "wav");
+
 	/**
 	 * Set GPT model
 	 * @param model Model name
 	 */
-	void setModel(const String& model) { _model = model; }
+	void setModel(GPTText model) { _model = model.release(); configChanged(CONFIG_MODEL); }
+
+	/**
+	 * Set the audio capable model used for audio prompts
+	 * @param model Model name
+	 */
+	void setAudioModel(GPTText model) { _audioModel = model.release(); configChanged(CONFIG_AUDIO_MODEL); }
 
 	/**
 	 * Set system message
 	 * @param message System prompt
 	 */
-	void setSystemMessage(const String& message) { _systemMessage = message; }
+	void setSystemMessage(GPTText message) { _systemMessage = message.release(); configChanged(CONFIG_SYSTEM_MESSAGE); }
+
+	/**
+	 * Set the key the server groups cached prompt prefixes by, e.g. a
+	 * device or conversation ID. Requests sharing it are routed to the
+	 * same prompt cache.
+	 * @param key Cache key, empty to not send one
+	 */
+	void setPromptCacheKey(GPTText key) { _promptCacheKey = key.release(); }
+
+	/**
+	 * Get token usage, prompt cache hits and response times
+	 * @return Usage statistics since the last reset
+	 */
+	UsageStats getUsageStats() const;
+
+	void resetUsageStats();
+
+	/**
+	 * Summarize older turns in the background once a conversation grows
+	 * past a budget. The summary replaces those turns in the context cache
+	 * and, with stored responses, starts a fresh response chain seeded with
+	 * it. The switch happens when the next prompt is built.
+	 * @param tokenBudget Input tokens of a turn that trigger compaction, 0 disables
+	 * @param byteBudget Bytes of cached history that trigger compaction, 0 disables
+	 */
+	void setCompactionBudget(uint32_t tokenBudget, size_t byteBudget = 0) {
+		_compactTokenBudget = tokenBudget;
+		_compactByteBudget = byteBudget;
+	}
+
+	/**
+	 * Set the model writing conversation summaries
+	 * @param model Model name, a cheap one is enough
+	 */
+	void setCompactionModel(GPTText model) { _compactModel = model.release(); }
 
 	/**
-	 * Get available GPT models (sorted by cost)
+	 * Keep the conversation state (response ID, recent history and
+	 * configuration) in a file so a conversation continues after deep
+	 * sleep or a reboot. The file is read on the first prompt; settings
+	 * made in code since boot take precedence over the stored ones.
+	 * Changes are written once none followed for delayMs.
+	 * @param fs Filesystem holding the state file, e.g. LittleFS
+	 * @param path Path of the state file
+	 * @param delayMs Write coalescing delay
+	 */
+	void enablePersistence(fs::FS& fs, GPTText path = "/gpt_state.bin", uint32_t delayMs = GPT_STATE_WRITE_DELAY_MS);
+
+	/**
+	 * Write pending state changes now, e.g. before entering deep sleep
+	 * @return true if the state file is up to date
+	 */
+	bool flushState();
+
+	/**
+	 * Get available GPT models (sorted by cost), checked against
+	 * gptCatalog and extended by it once it is loaded
 	 * @return Vector of available models
 	 */
 	static std::vector<GPTModel> getAvailableModels();
@@ -125,20 +299,97 @@ public:
 private:
 	String _apiKey;
 	String _model;
+	String _audioModel;
 	String _systemMessage;
 	bool _initialized;
 	ContextCache _contextCache;
 	bool _storeResponse; // Store gpt response as cache token
 	String _previousResponseId; // For conversation state
+	String _promptCacheKey;
+
+	UsageStats _usage;
+	uint32_t _lastTtfbMs; // of the request being processed
+	mutable portMUX_TYPE _usageLock = portMUX_INITIALIZER_UNLOCKED;
+
+	// Background compaction, see setCompactionBudget()
+	String _compactModel;
+	uint32_t _compactTokenBudget;
+	size_t _compactByteBudget;
+	uint32_t _lastInputTokens;   // input tokens of the last turn
+	bool _seedChain;             // next chain starts with the cached history
+	std::atomic<bool> _compacting;
+	std::atomic<bool> _summaryReady;
+	String _summary;             // written by the compaction task before _summaryReady
+	unsigned long _summaryUntil; // cached turns up to this time are summarized
+	uint32_t _summaryGeneration; // conversation the summary was written for
+	std::atomic<uint32_t> _conversationGeneration; // bumped by resetConversation()
+
+	// Summary request handed to the compaction task
+	struct CompactionJob;
+
+	// Settings made in code, kept when the stored state is restored
+	enum ConfigField : uint8_t {
+		CONFIG_MODEL = 1,
+		CONFIG_AUDIO_MODEL = 2,
+		CONFIG_SYSTEM_MESSAGE = 4
+	};
+
+	// Persisted conversation state, see enablePersistence()
+	fs::FS* _stateFs;
+	String _statePath;
+	uint32_t _stateDelay;
+	bool _stateRestored; // guarded by _stateLock
+	uint8_t _explicitConfig;
+	GPTString _stateRecord; // latest snapshot, written by the state task
+	bool _stateDirty;
+	SemaphoreHandle_t _stateLock;
+	TaskHandle_t _stateTask;
+
+	// Request handed to the HTTP task, owns the payload document and its arena
+	struct Request;
+
+	// Check the service state and start the HTTP task, takes ownership of request
+	void submit(Request* request);
+
+	// Send a payload with media streamed in place of its placeholder
+	static int sendMediaRequest(Request* request);
 
 	// Process API response
-	void processResponse(int httpCode, const String& response, const String& userPrompt, ResponseCallback callback);
+	void processResponse(int httpCode, const GPTString& response, const String& userPrompt, ResponseCallback callback, ArduinoJson::Allocator* allocator);
 
 	// Build JSON request payload
-	String buildJsonPayload(const String& userPrompt, const std::vector<std::pair<String, String>>& messages = {});
+	void buildJsonPayload(JsonDocument& doc, std::string_view userPrompt, const std::vector<std::pair<String, String>>& messages = {}, bool withImage = false);
+
+	// Build Chat Completions payload with an input_audio part
+	void buildAudioPayload(JsonDocument& doc, std::string_view userPrompt, const char* format);
+
+	// Extract response from JSON (Responses or Chat Completions format),
+	// continueChain keeps its ID and usage for the conversation
+	String extractResponse(std::string_view jsonResponse, ArduinoJson::Allocator* allocator, bool continueChain = true);
+
+	// Add the usage object of a reply (Responses or Chat Completions format)
+	void recordUsage(JsonVariantConst usage);
+
+	// Start summarizing older turns if the conversation is over budget
+	void checkCompaction();
+
+	// Swap a finished summary in, between two turns
+	void applyCompaction();
+
+	// Remember a setting made in code and schedule a state write
+	void configChanged(ConfigField field);
+
+	// Load the state file once, before the first payload is built
+	void restoreState();
+	void restoreStateLocked(); // callers hold _stateLock
+
+	// Snapshot the state under _stateLock and hand it to the state task
+	void saveState();
+
+	// Write the latest snapshot if it changed
+	bool writeState();
 
-	// Extract response from JSON
-	String extractResponse(const String& jsonResponse);
+	void stateTask();
 };
 
 extern GPTService ai;
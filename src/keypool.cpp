@@ -0,0 +1,186 @@
+#include "keypool.h"
+#include "log.h"
+
+GPTKeyPool::GPTKeyPool()
+	: _slots{}
+	, _count(0)
+	, _lock(xSemaphoreCreateMutex())
+{
+}
+
+GPTKeyPool::~GPTKeyPool() {
+	vSemaphoreDelete(_lock);
+}
+
+bool GPTKeyPool::addKey(const String& key, uint8_t weight) {
+	if (key.isEmpty() || weight == 0) {
+		return false;
+	}
+
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	bool added = _count < GPT_KEY_POOL_SIZE;
+	if (added) {
+		Slot& slot = _slots[_count++];
+		slot = Slot{};
+		slot.key = key;
+		slot.weight = weight;
+		slot.remainingRequests = -1;
+		slot.remainingTokens = -1;
+	}
+	xSemaphoreGive(_lock);
+	return added;
+}
+
+void GPTKeyPool::clear() {
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	for (size_t i = 0; i < _count; i++) {
+		_slots[i] = Slot{};
+	}
+	_count = 0;
+	xSemaphoreGive(_lock);
+}
+
+int GPTKeyPool::select(String& key) {
+	uint32_t now = millis();
+	int selected = -1;
+	int soonest = -1;
+	uint32_t soonestLeft = 0;
+	int32_t total = 0;
+
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	for (size_t i = 0; i < _count; i++) {
+		Slot& slot = _slots[i];
+		uint32_t left = blockedLeft(slot, now);
+		if (left > 0) {
+			if (soonest < 0 || left < soonestLeft) {
+				soonest = i;
+				soonestLeft = left;
+			}
+			continue;
+		}
+		slot.blockedFor = 0;
+
+		// Smooth weighted round-robin: heavier keys are picked more often,
+		// without bursts on one key
+		slot.current += slot.weight;
+		total += slot.weight;
+		if (selected < 0 || slot.current > _slots[selected].current) {
+			selected = i;
+		}
+	}
+
+	if (selected >= 0) {
+		_slots[selected].current -= total;
+	} else {
+		selected = soonest;
+	}
+	if (selected >= 0) {
+		key = _slots[selected].key;
+	}
+	xSemaphoreGive(_lock);
+	return selected;
+}
+
+void GPTKeyPool::report(int slot, int httpCode, const GPTRateLimitHeaders& headers) {
+	if (slot < 0) {
+		return;
+	}
+
+	uint32_t now = millis();
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	if ((size_t) slot >= _count) {
+		xSemaphoreGive(_lock);
+		return;
+	}
+
+	Slot& entry = _slots[slot];
+	entry.requests++;
+	if (!headers.remainingRequests.isEmpty()) {
+		entry.remainingRequests = headers.remainingRequests.toInt();
+	}
+	if (!headers.remainingTokens.isEmpty()) {
+		entry.remainingTokens = headers.remainingTokens.toInt();
+	}
+
+	if (httpCode == 429) {
+		entry.throttled++;
+		uint32_t duration = parseDuration(headers.retryAfter);
+		if (duration == 0) {
+			duration = max(parseDuration(headers.resetRequests), parseDuration(headers.resetTokens));
+		}
+		block(entry, duration > 0 ? duration : GPT_KEY_QUARANTINE_MS, now);
+		GPT_LOGW(KEYS, "Key %d throttled, quarantined for %u ms", slot, entry.blockedFor);
+	} else if (entry.remainingRequests == 0) {
+		block(entry, parseDuration(headers.resetRequests), now);
+	} else if (entry.remainingTokens == 0) {
+		block(entry, parseDuration(headers.resetTokens), now);
+	}
+	xSemaphoreGive(_lock);
+}
+
+GPTKeyPool::KeyStats GPTKeyPool::getStats(int slot) const {
+	KeyStats stats = {};
+	xSemaphoreTake(_lock, portMAX_DELAY);
+	if (slot >= 0 && (size_t) slot < _count) {
+		const Slot& entry = _slots[slot];
+		stats.requests = entry.requests;
+		stats.throttled = entry.throttled;
+		stats.remainingRequests = entry.remainingRequests;
+		stats.remainingTokens = entry.remainingTokens;
+		stats.blockedForMs = blockedLeft(entry, millis());
+		stats.weight = entry.weight;
+	}
+	xSemaphoreGive(_lock);
+	return stats;
+}
+
+uint32_t GPTKeyPool::parseDuration(const String& value) {
+	// Plain numbers are seconds (retry-after), otherwise Go style units
+	float total = 0;
+	float number = 0;
+	float scale = 0;
+	bool hasNumber = false;
+	for (size_t i = 0; i < value.length(); i++) {
+		char c = value[i];
+		if (isdigit(c)) {
+			if (scale > 0) {
+				number += (c - '0') * scale;
+				scale /= 10;
+			} else {
+				number = number * 10 + (c - '0');
+			}
+			hasNumber = true;
+		} else if (c == '.') {
+			scale = 0.1f;
+		} else if (hasNumber) {
+			if (c == 'm' && i + 1 < value.length() && value[i + 1] == 's') {
+				total += number;
+				i++;
+			} else if (c == 'h') {
+				total += number * 3600000;
+			} else if (c == 'm') {
+				total += number * 60000;
+			} else if (c == 's') {
+				total += number * 1000;
+			}
+			number = 0;
+			scale = 0;
+			hasNumber = false;
+		}
+	}
+	if (hasNumber) {
+		total += number * 1000;
+	}
+	return (uint32_t) total;
+}
+
+uint32_t GPTKeyPool::blockedLeft(const Slot& slot, uint32_t now) const {
+	uint32_t elapsed = now - slot.blockedAt;
+	return elapsed < slot.blockedFor ? slot.blockedFor - elapsed : 0;
+}
+
+void GPTKeyPool::block(Slot& slot, uint32_t duration, uint32_t now) {
+	slot.blockedAt = now;
+	slot.blockedFor = duration;
+	slot.current = 0;
+}
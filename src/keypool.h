@@ -0,0 +1,112 @@
+#ifndef GPT_KEYPOOL_H
+#define GPT_KEYPOOL_H
+
+#include <Arduino.h>
+#include "lazy.h"
+
+// Number of API keys a pool holds
+#ifndef GPT_KEY_POOL_SIZE
+#define GPT_KEY_POOL_SIZE 4
+#endif
+
+// Quarantine after a 429 that names no retry time
+#ifndef GPT_KEY_QUARANTINE_MS
+#define GPT_KEY_QUARANTINE_MS 20000
+#endif
+
+// Rate limit headers of one response, empty when not sent
+struct GPTRateLimitHeaders {
+	String remainingRequests; // x-ratelimit-remaining-requests
+	String remainingTokens;   // x-ratelimit-remaining-tokens
+	String resetRequests;     // x-ratelimit-reset-requests, e.g. "1s", "6m0s"
+	String resetTokens;       // x-ratelimit-reset-tokens
+	String retryAfter;        // retry-after, seconds
+};
+
+/**
+ * API keys the HTTP services spread their requests over. Keys are picked
+ * by smooth weighted round-robin; a key that used up its request or token
+ * budget sits out until the reported reset, and a key answered with 429
+ * is quarantined. While the pool is empty every service uses the key it
+ * was initialized with.
+ */
+class GPTKeyPool {
+public:
+	struct KeyStats {
+		uint32_t requests;         // responses seen
+		uint32_t throttled;        // 429 responses
+		int32_t remainingRequests; // last reported, -1 while unknown
+		int32_t remainingTokens;   // last reported, -1 while unknown
+		uint32_t blockedForMs;     // time left in quarantine
+		uint8_t weight;
+	};
+
+	GPTKeyPool();
+	~GPTKeyPool();
+
+	/**
+	 * Add a key
+	 * @param key OpenAI API key
+	 * @param weight Share of the requests relative to the other keys, e.g. its RPM tier
+	 * @return false if the pool is full or the key empty
+	 */
+	bool addKey(const String& key, uint8_t weight = 1);
+
+	/**
+	 * Remove all keys, the services fall back to their own key
+	 */
+	void clear();
+
+	size_t size() const { return _count; }
+
+	/**
+	 * Pick the key for the next request. When every key is blocked the one
+	 * free again soonest is used.
+	 * @param key Selected key
+	 * @return Slot to report the response to, -1 while the pool is empty
+	 */
+	int select(String& key);
+
+	/**
+	 * Feed back the response to a request made with a selected key
+	 * @param slot Slot returned by select()
+	 * @param httpCode HTTP status of the response
+	 * @param headers Rate limit headers of the response
+	 */
+	void report(int slot, int httpCode, const GPTRateLimitHeaders& headers);
+
+	/**
+	 * Get the counters and last known limits of a key
+	 * @param slot Key index, in the order the keys were added
+	 * @return Key statistics
+	 */
+	KeyStats getStats(int slot) const;
+
+private:
+	struct Slot {
+		String key;
+		uint8_t weight;
+		int32_t current; // smooth round-robin credit
+		uint32_t requests;
+		uint32_t throttled;
+		int32_t remainingRequests;
+		int32_t remainingTokens;
+		uint32_t blockedAt;
+		uint32_t blockedFor;
+	};
+
+	// "6m0s", "1.5s", "20ms" or plain seconds to milliseconds, 0 if empty
+	static uint32_t parseDuration(const String& value);
+
+	// Callers hold _lock
+	uint32_t blockedLeft(const Slot& slot, uint32_t now) const;
+	void block(Slot& slot, uint32_t duration, uint32_t now);
+
+	Slot _slots[GPT_KEY_POOL_SIZE];
+	size_t _count;
+	SemaphoreHandle_t _lock;
+};
+
+extern GPTLazy<GPTKeyPool> gptKeys;
+
+#endif // GPT_KEYPOOL_H
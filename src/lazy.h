@@ -0,0 +1,33 @@
+#ifndef GPT_LAZY_H
+#define GPT_LAZY_H
+
+#include <mutex>
+
+/**
+ * Global created on first use. It is constant initialized, so firmware
+ * that never touches it runs no constructor at boot and keeps the heap.
+ * Used like the pointer it replaces: gptHttp->begin(...), *gptWifiClient.
+ */
+template <typename T>
+class GPTLazy {
+public:
+	constexpr GPTLazy() {}
+
+	GPTLazy(const GPTLazy&) = delete;
+	GPTLazy& operator=(const GPTLazy&) = delete;
+
+	T* get() {
+		std::call_once(_once, [this]() { _instance = new T; });
+		return _instance;
+	}
+
+	T* operator->() { return get(); }
+	T& operator*() { return *get(); }
+	operator T*() { return get(); }
+
+private:
+	std::once_flag _once;
+	T* _instance = nullptr;
+};
+
+#endif // GPT_LAZY_H
@@ -0,0 +1,153 @@
+#ifndef GPT_LOG_H
+#define GPT_LOG_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define GPT_LOG_NONE 0
+#define GPT_LOG_ERROR 1
+#define GPT_LOG_WARN 2
+#define GPT_LOG_INFO 3
+#define GPT_LOG_DEBUG 4
+#define GPT_LOG_VERBOSE 5
+
+// Level of every module without its own, follows the core debug level
+#ifndef GPT_LOG_LEVEL
+#ifdef CORE_DEBUG_LEVEL
+#define GPT_LOG_LEVEL CORE_DEBUG_LEVEL
+#else
+#define GPT_LOG_LEVEL GPT_LOG_INFO
+#endif
+#endif
+
+// Per module levels, messages above them are not compiled at all,
+// including the formatting of their arguments
+#ifndef GPT_LOG_LEVEL_GPT
+#define GPT_LOG_LEVEL_GPT GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_TTS
+#define GPT_LOG_LEVEL_TTS GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_STT
+#define GPT_LOG_LEVEL_STT GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_STS
+#define GPT_LOG_LEVEL_STS GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_HTTP
+#define GPT_LOG_LEVEL_HTTP GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_DNS
+#define GPT_LOG_LEVEL_DNS GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_CATALOG
+#define GPT_LOG_LEVEL_CATALOG GPT_LOG_LEVEL
+#endif
+
+#ifndef GPT_LOG_LEVEL_KEYS
+#define GPT_LOG_LEVEL_KEYS GPT_LOG_LEVEL
+#endif
+
+#define GPT_LOG_TAG_GPT "GPT"
+#define GPT_LOG_TAG_TTS "TTS"
+#define GPT_LOG_TAG_STT "TRANSCRIPTION"
+#define GPT_LOG_TAG_STS "STS"
+#define GPT_LOG_TAG_HTTP "HTTP"
+#define GPT_LOG_TAG_DNS "DNS"
+#define GPT_LOG_TAG_CATALOG "CATALOG"
+#define GPT_LOG_TAG_KEYS "KEYS"
+
+// Longest excerpt GPT_LOG_PAYLOAD and GPT_LOG_JSON print
+#ifndef GPT_LOG_PAYLOAD_MAX
+#define GPT_LOG_PAYLOAD_MAX 200
+#endif
+
+#define GPT_LOG_ESP_ERROR(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define GPT_LOG_ESP_WARN(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define GPT_LOG_ESP_INFO(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define GPT_LOG_ESP_DEBUG(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+#define GPT_LOG_ESP_VERBOSE(tag, format, ...) ESP_LOGV(tag, format, ##__VA_ARGS__)
+
+// True if messages of the level are compiled for the module, e.g.
+// GPT_LOG_ENABLED(TTS, DEBUG) to guard a loop that only logs
+#define GPT_LOG_ENABLED(module, level) (GPT_LOG_LEVEL_##module >= GPT_LOG_##level)
+
+#define GPT_LOG(level, module, format, ...) do { \
+	if (GPT_LOG_ENABLED(module, level)) { \
+		GPT_LOG_ESP_##level(GPT_LOG_TAG_##module, format, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#define GPT_LOGE(module, format, ...) GPT_LOG(ERROR, module, format, ##__VA_ARGS__)
+#define GPT_LOGW(module, format, ...) GPT_LOG(WARN, module, format, ##__VA_ARGS__)
+#define GPT_LOGI(module, format, ...) GPT_LOG(INFO, module, format, ##__VA_ARGS__)
+#define GPT_LOGD(module, format, ...) GPT_LOG(DEBUG, module, format, ##__VA_ARGS__)
+#define GPT_LOGV(module, format, ...) GPT_LOG(VERBOSE, module, format, ##__VA_ARGS__)
+
+/**
+ * Lets one message of a call site through per interval and counts the
+ * ones dropped in between, see GPT_LOG_EVERY
+ */
+class GPTLogLimiter {
+public:
+	bool allow(uint32_t intervalMs, uint32_t& suppressed) {
+		uint32_t now = millis();
+		if (_printed && now - _last < intervalMs) {
+			_suppressed++;
+			return false;
+		}
+		_printed = true;
+		_last = now;
+		suppressed = _suppressed;
+		_suppressed = 0;
+		return true;
+	}
+
+private:
+	uint32_t _last = 0;
+	uint32_t _suppressed = 0;
+	bool _printed = false;
+};
+
+// At most one message per interval from this call site, for events that can repeat quickly
+#define GPT_LOG_EVERY(level, module, intervalMs, format, ...) do { \
+	if (GPT_LOG_ENABLED(module, level)) { \
+		static GPTLogLimiter _gptLogLimiter; \
+		uint32_t _gptLogSuppressed; \
+		if (_gptLogLimiter.allow(intervalMs, _gptLogSuppressed)) { \
+			if (_gptLogSuppressed > 0) { \
+				GPT_LOG_ESP_##level(GPT_LOG_TAG_##module, format " (%u similar suppressed)", ##__VA_ARGS__, (unsigned) _gptLogSuppressed); \
+			} else { \
+				GPT_LOG_ESP_##level(GPT_LOG_TAG_##module, format, ##__VA_ARGS__); \
+			} \
+		} \
+	} \
+} while (0)
+
+// Raw payload, cut to GPT_LOG_PAYLOAD_MAX characters
+#define GPT_LOG_PAYLOAD(level, module, label, data, length) do { \
+	if (GPT_LOG_ENABLED(module, level)) { \
+		size_t _gptLogLength = (length); \
+		GPT_LOG_ESP_##level(GPT_LOG_TAG_##module, "%s (%u bytes): %.*s%s", label, (unsigned) _gptLogLength, \
+			(int) (_gptLogLength < GPT_LOG_PAYLOAD_MAX ? _gptLogLength : GPT_LOG_PAYLOAD_MAX), (const char*) (data), \
+			_gptLogLength > GPT_LOG_PAYLOAD_MAX ? "..." : ""); \
+	} \
+} while (0)
+
+// JSON value serialized into a bounded stack buffer instead of a String
+#define GPT_LOG_JSON(level, module, label, value) do { \
+	if (GPT_LOG_ENABLED(module, level)) { \
+		char _gptLogBuffer[GPT_LOG_PAYLOAD_MAX + 1]; \
+		size_t _gptLogLength = serializeJson(value, _gptLogBuffer, sizeof(_gptLogBuffer)); \
+		GPT_LOG_ESP_##level(GPT_LOG_TAG_##module, "%s: %s%s", label, _gptLogBuffer, \
+			_gptLogLength >= GPT_LOG_PAYLOAD_MAX ? "..." : ""); \
+	} \
+} while (0)
+
+#endif // GPT_LOG_H
@@ -0,0 +1,245 @@
+#include "resolver.h"
+#include "log.h"
+#include <Network.h>
+
+GPTDnsCache::GPTDnsCache(uint32_t ttlMs)
+	: _entries{}
+	, _ttl(ttlMs)
+	, _stats{}
+	, _refreshTask(nullptr)
+	, _refreshStarting(false)
+{
+}
+
+GPTDnsCache::~GPTDnsCache() {
+	if (_refreshTask != nullptr) {
+		vTaskDelete(_refreshTask);
+		_refreshTask = nullptr;
+	}
+}
+
+bool GPTDnsCache::resolve(const char* host, IPAddress& address) {
+	if (host == nullptr || *host == '\0') {
+		return false;
+	}
+
+	// Literal addresses need no lookup
+	if (address.fromString(host)) {
+		return true;
+	}
+
+	if (strlen(host) >= GPT_DNS_HOST_LENGTH) {
+		return lookup(host, address);
+	}
+
+	uint32_t now = millis();
+	bool refresh = false;
+	bool hit = false;
+
+	portENTER_CRITICAL(&_lock);
+	Entry* entry = find(host);
+	if (entry != nullptr && entry->valid && now - entry->resolvedAt < _ttl) {
+		address = entry->address;
+		entry->lastUsed = now;
+		_stats.hits++;
+		hit = true;
+
+		// Refresh ahead so the next use does not wait for the lookup
+		if (now - entry->resolvedAt >= _ttl - _ttl / 5 && !entry->refreshPending) {
+			entry->refreshPending = true;
+			refresh = true;
+		}
+	} else {
+		_stats.misses++;
+	}
+	portEXIT_CRITICAL(&_lock);
+
+	if (hit) {
+		if (refresh) {
+			scheduleRefresh();
+		}
+		return true;
+	}
+
+	IPAddress resolved;
+	if (lookup(host, resolved)) {
+		store(host, resolved);
+		address = resolved;
+		return true;
+	}
+
+	// Keep going with the last address that worked
+	portENTER_CRITICAL(&_lock);
+	entry = find(host);
+	if (entry != nullptr && entry->valid) {
+		address = entry->address;
+		entry->lastUsed = now;
+		_stats.staleHits++;
+		hit = true;
+	}
+	portEXIT_CRITICAL(&_lock);
+
+	if (hit) {
+		GPT_LOGW(DNS, "Lookup of %s failed, using last known address %s", host, address.toString().c_str());
+	}
+	return hit;
+}
+
+void GPTDnsCache::invalidate(const char* host) {
+	portENTER_CRITICAL(&_lock);
+	Entry* entry = find(host);
+	if (entry != nullptr) {
+		entry->valid = false;
+		entry->host[0] = '\0';
+	}
+	portEXIT_CRITICAL(&_lock);
+}
+
+void GPTDnsCache::clear() {
+	portENTER_CRITICAL(&_lock);
+	for (Entry& entry : _entries) {
+		entry.valid = false;
+		entry.refreshPending = false;
+		entry.host[0] = '\0';
+	}
+	portEXIT_CRITICAL(&_lock);
+}
+
+GPTDnsCache::Stats GPTDnsCache::getStats() const {
+	portENTER_CRITICAL(&_lock);
+	Stats stats = _stats;
+	portEXIT_CRITICAL(&_lock);
+	return stats;
+}
+
+GPTDnsCache::Entry* GPTDnsCache::find(const char* host) {
+	for (Entry& entry : _entries) {
+		if (entry.host[0] != '\0' && strcmp(entry.host, host) == 0) {
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+GPTDnsCache::Entry* GPTDnsCache::slotFor(const char* host) {
+	Entry* entry = find(host);
+	if (entry != nullptr) {
+		return entry;
+	}
+
+	// Free slot, else the least recently used one
+	Entry* oldest = &_entries[0];
+	for (Entry& candidate : _entries) {
+		if (candidate.host[0] == '\0') {
+			return &candidate;
+		}
+		if ((long) (candidate.lastUsed - oldest->lastUsed) < 0) {
+			oldest = &candidate;
+		}
+	}
+	return oldest;
+}
+
+bool GPTDnsCache::lookup(const char* host, IPAddress& address) {
+	uint32_t start = millis();
+	bool ok = Network.hostByName(host, address) == 1;
+	uint32_t elapsed = millis() - start;
+
+	portENTER_CRITICAL(&_lock);
+	_stats.resolutions++;
+	_stats.lastResolveMs = elapsed;
+	_stats.totalResolveMs += elapsed;
+	if (elapsed > _stats.maxResolveMs) {
+		_stats.maxResolveMs = elapsed;
+	}
+	if (!ok) {
+		_stats.failures++;
+	}
+	portEXIT_CRITICAL(&_lock);
+
+	if (ok) {
+		GPT_LOGD(DNS, "Resolved %s to %s in %u ms", host, address.toString().c_str(), elapsed);
+	} else {
+		GPT_LOGW(DNS, "Failed to resolve %s after %u ms", host, elapsed);
+	}
+	return ok;
+}
+
+void GPTDnsCache::store(const char* host, const IPAddress& address) {
+	if (strlen(host) >= GPT_DNS_HOST_LENGTH) {
+		return;
+	}
+
+	uint32_t now = millis();
+	portENTER_CRITICAL(&_lock);
+	Entry* entry = slotFor(host);
+	strcpy(entry->host, host);
+	entry->address = address;
+	entry->resolvedAt = now;
+	entry->lastUsed = now;
+	entry->valid = true;
+	entry->refreshPending = false;
+	portEXIT_CRITICAL(&_lock);
+}
+
+void GPTDnsCache::scheduleRefresh() {
+	// One caller claims the creation under the lock; a task cannot be
+	// created inside the critical section itself
+	portENTER_CRITICAL(&_lock);
+	bool create = _refreshTask == nullptr && !_refreshStarting;
+	if (create) {
+		_refreshStarting = true;
+	}
+	TaskHandle_t task = _refreshTask;
+	portEXIT_CRITICAL(&_lock);
+
+	if (create) {
+		xTaskCreatePinnedToCore([](void* param) {
+			static_cast<GPTDnsCache*>(param)->refreshTask();
+		}, "GPT_DNS", 4096, this, 1, &task, 0);
+
+		portENTER_CRITICAL(&_lock);
+		_refreshTask = task;
+		_refreshStarting = false;
+		portEXIT_CRITICAL(&_lock);
+	}
+
+	// Callers racing the creation leave their entry pending, the first
+	// pass of the new task picks it up
+	if (task != nullptr) {
+		xTaskNotifyGive(task);
+	}
+}
+
+void GPTDnsCache::refreshTask() {
+	char host[GPT_DNS_HOST_LENGTH];
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		while (true) {
+			host[0] = '\0';
+			portENTER_CRITICAL(&_lock);
+			for (Entry& entry : _entries) {
+				if (entry.refreshPending && entry.host[0] != '\0') {
+					entry.refreshPending = false;
+					strcpy(host, entry.host);
+					break;
+				}
+			}
+			portEXIT_CRITICAL(&_lock);
+
+			if (host[0] == '\0') {
+				break;
+			}
+
+			// A failed refresh keeps the current address until it expires
+			IPAddress address;
+			if (lookup(host, address)) {
+				store(host, address);
+				portENTER_CRITICAL(&_lock);
+				_stats.refreshes++;
+				portEXIT_CRITICAL(&_lock);
+			}
+		}
+	}
+}
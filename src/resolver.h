@@ -0,0 +1,109 @@
+#ifndef GPT_RESOLVER_H
+#define GPT_RESOLVER_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+#include "lazy.h"
+
+// How long a resolved address is used before it is looked up again.
+// lwIP does not report record TTLs, so this is a fixed upper bound.
+#ifndef GPT_DNS_TTL_MS
+#define GPT_DNS_TTL_MS (5 * 60 * 1000)
+#endif
+
+// Number of host names kept
+#ifndef GPT_DNS_CACHE_SIZE
+#define GPT_DNS_CACHE_SIZE 4
+#endif
+
+// Longer host names bypass the cache
+#ifndef GPT_DNS_HOST_LENGTH
+#define GPT_DNS_HOST_LENGTH 64
+#endif
+
+/**
+ * Host name cache of the HTTP transport. Entries used during the last
+ * fifth of their lifetime are refreshed by a background task, and a
+ * failed lookup falls back to the last address that resolved. The
+ * realtime WebSocket resolves its host on its own and is not covered.
+ */
+class GPTDnsCache {
+public:
+	struct Stats {
+		uint32_t hits;          // answered from the cache
+		uint32_t misses;        // had to resolve before answering
+		uint32_t staleHits;     // lookup failed, last known address used
+		uint32_t failures;      // lookups that failed
+		uint32_t refreshes;     // background refreshes
+		uint32_t lastResolveMs; // duration of the last lookup
+		uint32_t maxResolveMs;  // slowest lookup
+		uint32_t totalResolveMs;
+		uint32_t resolutions;   // lookups performed, average = totalResolveMs / resolutions
+	};
+
+	GPTDnsCache(uint32_t ttlMs = GPT_DNS_TTL_MS);
+	~GPTDnsCache();
+
+	/**
+	 * Set how long resolved addresses are used
+	 * @param ttlMs Lifetime in milliseconds
+	 */
+	void setTtl(uint32_t ttlMs) { _ttl = ttlMs; }
+
+	/**
+	 * Resolve a host name through the cache
+	 * @param host Host name
+	 * @param address Resolved address
+	 * @return true if an address is available
+	 */
+	bool resolve(const char* host, IPAddress& address);
+
+	/**
+	 * Drop the cached address of a host, e.g. after a failed connect
+	 * @param host Host name
+	 */
+	void invalidate(const char* host);
+
+	/**
+	 * Drop every cached address
+	 */
+	void clear();
+
+	/**
+	 * Get hit / miss counters and lookup times
+	 * @return Cache statistics
+	 */
+	Stats getStats() const;
+
+private:
+	struct Entry {
+		char host[GPT_DNS_HOST_LENGTH];
+		IPAddress address;
+		uint32_t resolvedAt;
+		uint32_t lastUsed;
+		bool valid;
+		bool refreshPending;
+	};
+
+	// Callers hold _lock
+	Entry* find(const char* host);
+	Entry* slotFor(const char* host);
+
+	// Timed lookup, updates the statistics
+	bool lookup(const char* host, IPAddress& address);
+	void store(const char* host, const IPAddress& address);
+
+	void scheduleRefresh();
+	void refreshTask();
+
+	Entry _entries[GPT_DNS_CACHE_SIZE];
+	uint32_t _ttl;
+	Stats _stats;
+	TaskHandle_t _refreshTask;
+	bool _refreshStarting; // a caller is creating _refreshTask
+	mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern GPTLazy<GPTDnsCache> gptDns;
+
+#endif // GPT_RESOLVER_H
@@ -0,0 +1,119 @@
+#ifndef GPT_TOOL_SCHEMA_H
+#define GPT_TOOL_SCHEMA_H
+
+#include <array>
+#include <cstddef>
+
+// JSON schema type of a tool parameter
+enum class GPTToolParamType {
+	GPT_STRING,
+	GPT_INTEGER,
+	GPT_NUMBER,
+	GPT_BOOLEAN
+};
+
+// Tool parameter descriptor. Parameter structs declare
+// static constexpr GPTToolParam params[] = { ... };
+struct GPTToolParam {
+	const char* name;
+	GPTToolParamType type;
+	const char* description;
+	bool required;
+};
+
+namespace gpt_schema {
+
+// Writes into a fixed buffer, or only counts when Capacity is 0
+template<size_t Capacity>
+struct Writer {
+	std::array<char, Capacity + 1> out{};
+	size_t pos = 0;
+
+	constexpr void put(char c) {
+		if (pos < Capacity) {
+			out[pos] = c;
+		}
+		pos++;
+	}
+
+	constexpr void raw(const char* str) {
+		while (*str) {
+			put(*str++);
+		}
+	}
+
+	constexpr void quoted(const char* str) {
+		put('"');
+		for (; *str; str++) {
+			if (*str == '"' || *str == '\\') {
+				put('\\');
+			}
+			put(*str);
+		}
+		put('"');
+	}
+};
+
+constexpr const char* typeName(GPTToolParamType type) {
+	switch (type) {
+		case GPTToolParamType::GPT_INTEGER: return "integer";
+		case GPTToolParamType::GPT_NUMBER: return "number";
+		case GPTToolParamType::GPT_BOOLEAN: return "boolean";
+		default: return "string";
+	}
+}
+
+template<size_t Capacity, size_t N>
+constexpr Writer<Capacity> write(const GPTToolParam (&params)[N]) {
+	Writer<Capacity> writer;
+	writer.raw("{\"type\":\"object\",\"properties\":{");
+	for (size_t i = 0; i < N; i++) {
+		if (i > 0) {
+			writer.put(',');
+		}
+		writer.quoted(params[i].name);
+		writer.raw(":{\"type\":");
+		writer.quoted(typeName(params[i].type));
+		if (params[i].description != nullptr) {
+			writer.raw(",\"description\":");
+			writer.quoted(params[i].description);
+		}
+		writer.put('}');
+	}
+	writer.raw("},\"required\":[");
+	bool first = true;
+	for (size_t i = 0; i < N; i++) {
+		if (!params[i].required) {
+			continue;
+		}
+		if (!first) {
+			writer.put(',');
+		}
+		writer.quoted(params[i].name);
+		first = false;
+	}
+	writer.raw("]}");
+	return writer;
+}
+
+} // namespace gpt_schema
+
+/**
+ * JSON schema of a tool parameter struct, generated at compile time
+ * and stored in flash.
+ *
+ * struct LightParams {
+ *     static constexpr GPTToolParam params[] = {
+ *         {"room", GPTToolParamType::GPT_STRING, "Room name", true},
+ *         {"level", GPTToolParamType::GPT_INTEGER, "Brightness 0-100", false}
+ *     };
+ * };
+ * GPTToolSchema<LightParams>::json.data()
+ */
+template<typename Params>
+struct GPTToolSchema {
+	static constexpr size_t length = gpt_schema::write<0>(Params::params).pos;
+	static constexpr std::array<char, length + 1> json = gpt_schema::write<length>(Params::params).out;
+};
+
+#endif // GPT_TOOL_SCHEMA_H
\ No newline at end of file
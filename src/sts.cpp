@@ -1,3 +1,6 @@
+#include "config.h"
+
+#if GPT_ENABLE_STS
 #include "sts.h"
 
 #include <WiFi.h>
@@ -17,16 +20,33 @@ static const size_t NUM_MODELS = sizeof(AVAILABLE_MODELS) / sizeof(AVAILABLE_MOD
 
 GPTStsService::GPTStsService()
 	: _model("gpt-realtime-mini")
-	, _voice("shimmer")
 	, _initialized(false)
+	, _sessionConfig()
+	, _sessionConfigCache()
+	, _configMutex(nullptr)
+	, _documentPool()
 	, _isStreaming(false)
+	, _sessionCreated(false)
 	, _streamingTask(nullptr)
+	, _streamingExited(nullptr)
+	, _sendMutex(nullptr)
 	, _isGPTSpeaking(false)
 	, _eventConnectedCallback(nullptr)
 	, _eventUpdatedCallback(nullptr)
 	, _eventFunctionCallback(nullptr)
 	, _eventDisconnectCallback(nullptr)
+	, _transcriptCallback(nullptr)
 	, _tools()
+	, _toolsCache()
+	, _pendingArguments()
+	, _toolQueue(nullptr)
+	, _toolWorkers{}
+	, _toolMutex(nullptr)
+	, _toolWorkersExited(nullptr)
+	, _toolOutputs()
+	, _pendingToolCalls(0)
+	, _toolResponseDone(true)
+	, _toolDeadline(0)
 {
 }
 
@@ -36,100 +56,458 @@ GPTStsService::~GPTStsService() {
 
 bool GPTStsService::init(const String& apiKey) {
 	if (apiKey.length() == 0) {
-		ESP_LOGE("STS", "API key is empty");
+		GPT_LOGE(STS, "API key is empty");
 		return false;
 	}
 
 	_apiKey = apiKey;
+	if (_sendMutex == nullptr) {
+		_sendMutex = xSemaphoreCreateRecursiveMutex();
+	}
+	if (_configMutex == nullptr) {
+		_configMutex = xSemaphoreCreateMutex();
+	}
 	_initialized = true;
 
-	ESP_LOGI("STS", "Speech-to-speech service initialized with model: %s", _model.c_str());
+	GPT_LOGI(STS, "Speech-to-speech service initialized with model: %s", _model.c_str());
 	return true;
 }
 
-String GPTStsService::buildSessionConfig() {
-	GPTSpiJsonDocument doc;
-	doc["type"] = "session.update";
-	doc["session"]["type"] = "realtime";
-	doc["session"]["max_output_tokens"] = 1024;
-	doc["session"]["model"] = _model.c_str();
+size_t GPTStsService::writeSessionConfig(JsonObject session, const SessionConfig& config, const SessionConfig* previous) {
+	size_t written = 0;
+	auto differs = [&](auto member) {
+		return previous == nullptr || previous->*member != config.*member;
+	};
+
+	if (previous == nullptr) {
+		session["model"] = _model.c_str();
+	}
+
+	if (differs(&SessionConfig::maxOutputTokens)) {
+		if (config.maxOutputTokens > 0) {
+			session["max_output_tokens"] = config.maxOutputTokens;
+		} else {
+			session["max_output_tokens"] = "inf";
+		}
+		written++;
+	}
 
 	// Output modality
-	doc["session"]["output_modalities"][0] = "audio";
+	if (differs(&SessionConfig::textOnly)) {
+		session["output_modalities"][0] = config.textOnly ? "text" : "audio";
+		written++;
+	}
 
 	// Instructions
-	doc["session"]["instructions"] =
-			"You are a calm, monotone AI assistant. "
-			"Speak in short, efficient sentences. "
-			"Avoid emotional language. "
-			"Report confidence or probability only when it is relevant. "
-			"Use dry, understated humor. "
-			"Maintain a robotic, professional tone at all times. "
-			"Include humor most of the time. "
-			"Include numeric confidence occasionally, but only if relevant. "
-			"If your answer is long, break it into multiple short statements.";
+	if (differs(&SessionConfig::instructions)) {
+		session["instructions"] = config.instructions;
+		written++;
+	}
 
 	// Audio input config
-	doc["session"]["audio"]["input"]["format"]["type"] = "audio/pcm";
-	doc["session"]["audio"]["input"]["format"]["rate"] = 24000;
-	doc["session"]["audio"]["input"]["noise_reduction"]["type"] = "near_field";
+	JsonObject input = session["audio"]["input"].to<JsonObject>();
+	if (differs(&SessionConfig::inputSampleRate)) {
+		input["format"]["type"] = "audio/pcm";
+		input["format"]["rate"] = config.inputSampleRate;
+		written++;
+	}
+	if (differs(&SessionConfig::noiseReduction)) {
+		if (config.noiseReduction.length() > 0) {
+			input["noise_reduction"]["type"] = config.noiseReduction;
+		} else {
+			input["noise_reduction"] = nullptr;
+		}
+		written++;
+	}
 
 	// Transcription config
-	doc["session"]["audio"]["input"]["transcription"]["model"] = "gpt-4o-mini-transcribe";
+	if (differs(&SessionConfig::transcriptionModel)) {
+		if (config.transcriptionModel.length() > 0) {
+			input["transcription"]["model"] = config.transcriptionModel;
+		} else {
+			input["transcription"] = nullptr;
+		}
+		written++;
+	}
 
-	// Turn detection / VAD
-	doc["session"]["audio"]["input"]["turn_detection"]["type"] = "server_vad";
-	doc["session"]["audio"]["input"]["turn_detection"]["interrupt_response"] = false;
-	doc["session"]["audio"]["input"]["turn_detection"]["prefix_padding_ms"] = 300;
-	doc["session"]["audio"]["input"]["turn_detection"]["silence_duration_ms"] = 3000;
-	doc["session"]["audio"]["input"]["turn_detection"]["threshold"] = 0.5;
+	// Turn detection / VAD, the object is replaced as a whole
+	if (differs(&SessionConfig::turnDetection) || differs(&SessionConfig::interruptResponse)
+		|| differs(&SessionConfig::prefixPaddingMs) || differs(&SessionConfig::silenceDurationMs)
+		|| differs(&SessionConfig::vadThreshold)) {
+		if (config.turnDetection.length() > 0) {
+			JsonObject turnDetection = input["turn_detection"].to<JsonObject>();
+			turnDetection["type"] = config.turnDetection;
+			turnDetection["interrupt_response"] = config.interruptResponse;
+			if (config.turnDetection == "server_vad") {
+				turnDetection["prefix_padding_ms"] = config.prefixPaddingMs;
+				turnDetection["silence_duration_ms"] = config.silenceDurationMs;
+				turnDetection["threshold"] = config.vadThreshold;
+			}
+		} else {
+			input["turn_detection"] = nullptr;
+		}
+		written++;
+	}
+	if (input.size() == 0) {
+		session["audio"].remove("input");
+	}
 
 	// Audio output config (voice + format)
-	doc["session"]["audio"]["output"]["format"]["type"] = "audio/pcm";
-	doc["session"]["audio"]["output"]["format"]["rate"] = 24000;
-	doc["session"]["audio"]["output"]["voice"] = _voice.c_str();
-	doc["session"]["tool_choice"] = "auto";
+	JsonObject output = session["audio"]["output"].to<JsonObject>();
+	if (differs(&SessionConfig::outputSampleRate)) {
+		output["format"]["type"] = "audio/pcm";
+		output["format"]["rate"] = config.outputSampleRate;
+		written++;
+	}
+	if (differs(&SessionConfig::voice)) {
+		output["voice"] = config.voice;
+		written++;
+	}
+	if (output.size() == 0) {
+		session["audio"].remove("output");
+	}
+	if (session["audio"].size() == 0) {
+		session.remove("audio");
+	}
 
-	String config;
-	serializeJson(doc, config);
-	return config;
+	if (differs(&SessionConfig::toolChoice)) {
+		session["tool_choice"] = config.toolChoice;
+		written++;
+	}
+
+	return written;
 }
 
-void GPTStsService::addTool(const GPTTool& tool){
-	_tools.push_back(tool);
+bool GPTStsService::sendSessionConfig() {
+	// Runs inside the socket loop, which already holds _sendMutex; the
+	// setters never wait for it while holding _configMutex
+	lockConfig();
+	if (_sessionConfigCache.isEmpty()) {
+		GPTSpiJsonDocument doc;
+		doc["type"] = "session.update";
+		JsonObject session = doc["session"].to<JsonObject>();
+		session["type"] = "realtime";
+		writeSessionConfig(session, _sessionConfig);
+		_sessionConfigCache.reserve(measureJson(doc));
+		serializeJson(doc, _sessionConfigCache);
+	}
+	bool sent = sendMessage(_sessionConfigCache.c_str(), _sessionConfigCache.length());
+	unlockConfig();
+	return sent;
 }
 
-bool GPTStsService::sendTools() {
+bool GPTStsService::setSessionConfig(const SessionConfig& config) {
 	GPTSpiJsonDocument doc;
 	doc["type"] = "session.update";
-	doc["session"]["type"] = "realtime";
-	for(int i = 0; i < _tools.size(); i++) {
-		doc["session"]["tools"][i]["description"] = _tools[i].description;
-		doc["session"]["tools"][i]["name"] = _tools[i].name;
-		doc["session"]["tools"][i]["parameters"] = _tools[i].params;
-		doc["session"]["tools"][i]["type"] = "function";
+	JsonObject session = doc["session"].to<JsonObject>();
+	session["type"] = "realtime";
+
+	lockConfig();
+	SessionConfig previous = _sessionConfig;
+	_sessionConfig = config;
+
+	// Rebuilt on the next session.created
+	_sessionConfigCache.clear();
+	size_t changed = writeSessionConfig(session, _sessionConfig, &previous);
+	unlockConfig();
+
+	if (!_sessionCreated || !gptWebSocket->isConnected() || changed == 0) {
+		return true;
+	}
+
+	GPT_LOGI(STS, "Sending session update (%d fields)", changed);
+	return sendJson(doc);
+}
+
+void GPTStsService::setModel(GPTText model) {
+	lockConfig();
+	_model = model.release();
+
+	// The cached session.update names the model
+	_sessionConfigCache.clear();
+	unlockConfig();
+}
+
+void GPTStsService::setVoice(GPTText voice) {
+	lockConfig();
+	SessionConfig config = _sessionConfig;
+	unlockConfig();
+	config.voice = voice.release();
+	setSessionConfig(config);
+}
+
+void GPTStsService::setTextOnly(bool textOnly) {
+	lockConfig();
+	SessionConfig config = _sessionConfig;
+	unlockConfig();
+	config.textOnly = textOnly;
+	setSessionConfig(config);
+}
+
+void GPTStsService::lockConfig() {
+	if (_configMutex != nullptr) {
+		xSemaphoreTake(_configMutex, portMAX_DELAY);
+	}
+}
+
+void GPTStsService::unlockConfig() {
+	if (_configMutex != nullptr) {
+		xSemaphoreGive(_configMutex);
+	}
+}
+
+void GPTStsService::addTool(GPTTool&& tool){
+	_tools.push_back(std::move(tool));
+	_toolsCache.clear();
+}
+
+void GPTStsService::addTool(const GPTTool& tool){
+	addTool(GPTTool(tool));
+}
+
+bool GPTStsService::sendTools() {
+	if (_toolsCache.isEmpty()) {
+		GPTSpiJsonDocument doc;
+		doc["type"] = "session.update";
+		doc["session"]["type"] = "realtime";
+		JsonArray tools = doc["session"]["tools"].to<JsonArray>();
+		for (const GPTTool& tool : _tools) {
+			JsonObject item = tools.add<JsonObject>();
+			item["description"] = tool.description;
+			item["name"] = tool.name;
+			if (tool.schema != nullptr) {
+				item["parameters"] = serialized(tool.schema);
+			} else {
+				item["parameters"] = tool.params;
+			}
+			item["type"] = "function";
+		}
+		_toolsCache.reserve(measureJson(doc));
+		serializeJson(doc, _toolsCache);
 	}
-	
-	return gptWebSocket->sendTXT(doc.as<String>().c_str());
+
+	return sendMessage(_toolsCache.c_str(), _toolsCache.length());
 }
 
 bool GPTStsService::sendToolCallback(const GPTToolCallback& toolCallback) {
+	if (_toolMutex == nullptr) {
+		GPT_LOGE(STS, "Tool output dropped, streaming not started");
+		return false;
+	}
+
 	GPTSpiJsonDocument doc;
-	// mode 1
 	doc["type"] = "conversation.item.create";
 	doc["item"]["type"] = "function_call_output";
 	doc["item"]["call_id"] = toolCallback.callId;
 	doc["item"]["output"] = toolCallback.output;
-	if (!gptWebSocket->sendTXT(doc.as<String>().c_str())) {
+
+	GPTString message;
+	message.reserve(measureJson(doc));
+	serializeJson(doc, message);
+
+	// Sent from the streaming task together with the other outputs of the response
+	xSemaphoreTake(_toolMutex, portMAX_DELAY);
+	_toolOutputs.push_back(std::move(message));
+	if (_pendingToolCalls > 0) {
+		_pendingToolCalls--;
+	}
+	xSemaphoreGive(_toolMutex);
+
+	GPT_LOG_PAYLOAD(DEBUG, STS, "Queued tool output", toolCallback.output, strlen(toolCallback.output));
+	return true;
+}
+
+void GPTStsService::flushToolOutputs() {
+	std::vector<GPTString> outputs;
+
+	xSemaphoreTake(_toolMutex, portMAX_DELAY);
+	bool timedOut = _pendingToolCalls > 0 && (long)(millis() - _toolDeadline) >= 0;
+	if (timedOut) {
+		GPT_LOGW(STS, "%d tool calls did not answer in time", _pendingToolCalls);
+		_pendingToolCalls = 0;
+	}
+	if (!_toolOutputs.empty() && _toolResponseDone && _pendingToolCalls == 0) {
+		outputs.swap(_toolOutputs);
+	}
+	xSemaphoreGive(_toolMutex);
+
+	if (outputs.empty()) {
+		return;
+	}
+
+	for (const GPTString& message : outputs) {
+		sendMessage(message.c_str(), message.length());
+	}
+
+	// trigger model to speak once for the whole batch
+	GPT_LOGI(STS, "Sending response.create for %d tool outputs", outputs.size());
+	Speak();
+}
+
+void GPTStsService::appendToolArguments(const char* callId, const char* delta) {
+	for (PendingArguments& pending : _pendingArguments) {
+		if (pending.callId == callId) {
+			pending.arguments += delta;
+			return;
+		}
+	}
+
+	PendingArguments pending;
+	pending.callId = callId;
+	pending.arguments += delta;
+	_pendingArguments.push_back(std::move(pending));
+}
+
+void GPTStsService::dispatchToolCall(JsonDocument& event) {
+	const char* callId = event["call_id"] | "";
+	const char* name = event["name"] | "";
+
+	GPTToolCall* call = new GPTToolCall{};
+	size_t callIdLength = strlen(callId);
+	size_t nameLength = strlen(name);
+	call->storage.reset(new char[callIdLength + nameLength + 2]);
+	memcpy(call->storage.get(), callId, callIdLength + 1);
+	memcpy(call->storage.get() + callIdLength + 1, name, nameLength + 1);
+	call->callId = call->storage.get();
+	call->name = call->storage.get() + callIdLength + 1;
+
+	// Parse the arguments accumulated from delta events, else the final copy
+	call->document = _documentPool.lease();
+	DeserializationError error = DeserializationError::EmptyInput;
+	for (auto it = _pendingArguments.begin(); it != _pendingArguments.end(); ++it) {
+		if (it->callId == callId) {
+			error = deserializeJson(*call->document, it->arguments.c_str(), it->arguments.length());
+			_pendingArguments.erase(it);
+			break;
+		}
+	}
+	if (error == DeserializationError::EmptyInput && event["arguments"].is<const char*>()) {
+		error = deserializeJson(*call->document, event["arguments"].as<const char*>());
+	}
+	call->params = call->document->as<JsonVariantConst>();
+	if (error) {
+		GPT_LOGW(STS, "Failed to parse arguments of %s: %s", call->name, error.c_str());
+	}
+
+	xSemaphoreTake(_toolMutex, portMAX_DELAY);
+	_pendingToolCalls++;
+	_toolDeadline = millis() + GPT_STS_TOOL_TIMEOUT_MS;
+	xSemaphoreGive(_toolMutex);
+
+	if (xQueueSend(_toolQueue, &call, 0) != pdTRUE) {
+		GPT_LOG_EVERY(ERROR, STS, 1000, "Tool queue full, dropping call %s", call->name);
+		xSemaphoreTake(_toolMutex, portMAX_DELAY);
+		_pendingToolCalls--;
+		xSemaphoreGive(_toolMutex);
+		delete call;
+	}
+}
+
+void GPTStsService::toolWorkerTask() {
+	GPTToolCall* call = nullptr;
+	while (true) {
+		if (xQueueReceive(_toolQueue, &call, portMAX_DELAY) != pdTRUE) {
+			continue;
+		}
+		if (call == nullptr) {
+			break; // stop sentinel, see stopToolWorkers()
+		}
+
+		GPT_LOGD(STS, "Executing tool %s (%s)", call->name, call->callId);
+		if (_eventFunctionCallback) {
+			_eventFunctionCallback(*call);
+		}
+		delete call;
+		call = nullptr;
+	}
+
+	xSemaphoreGive(_toolWorkersExited);
+}
+
+void GPTStsService::startToolWorkers() {
+	if (_toolMutex == nullptr) {
+		_toolMutex = xSemaphoreCreateMutex();
+	}
+	if (_toolQueue == nullptr) {
+		_toolQueue = xQueueCreate(8, sizeof(GPTToolCall*));
+	}
+	if (_toolWorkersExited == nullptr) {
+		_toolWorkersExited = xSemaphoreCreateCounting(GPT_STS_TOOL_WORKERS, 0);
+	}
+
+	for (size_t i = 0; i < GPT_STS_TOOL_WORKERS; i++) {
+		if (_toolWorkers[i] != nullptr) {
+			continue;
+		}
+		xTaskCreatePinnedToCore([](void* param) {
+			static_cast<GPTStsService*>(param)->toolWorkerTask();
+			vTaskDelete(NULL);
+		}, "STS_Tool", GPT_STS_TOOL_WORKER_STACK, this, 5, &_toolWorkers[i], 0);
+	}
+}
+
+void GPTStsService::stopToolWorkers() {
+	// Calls not picked up yet are dropped
+	GPTToolCall* call = nullptr;
+	while (_toolQueue != nullptr && xQueueReceive(_toolQueue, &call, 0) == pdTRUE) {
+		delete call;
+	}
+
+	// Workers finish the call they are running and exit on a nullptr each,
+	// so none is killed while it holds _toolMutex or a pooled document
+	size_t running = 0;
+	for (size_t i = 0; i < GPT_STS_TOOL_WORKERS; i++) {
+		if (_toolWorkers[i] != nullptr) {
+			call = nullptr;
+			xQueueSend(_toolQueue, &call, portMAX_DELAY);
+			running++;
+		}
+	}
+	for (size_t i = 0; i < running; i++) {
+		xSemaphoreTake(_toolWorkersExited, portMAX_DELAY);
+	}
+	// Cleared only now, a worker still in its callback is recognized by stop()
+	for (size_t i = 0; i < GPT_STS_TOOL_WORKERS; i++) {
+		_toolWorkers[i] = nullptr;
+	}
+
+	if (_toolMutex != nullptr) {
+		xSemaphoreTake(_toolMutex, portMAX_DELAY);
+		_toolOutputs.clear();
+		_pendingToolCalls = 0;
+		_toolResponseDone = true;
+		xSemaphoreGive(_toolMutex);
+	}
+	_pendingArguments.clear();
+}
+
+bool GPTStsService::sendText(GPTText text, bool textOnly) {
+	if (!_isStreaming || !gptWebSocket->isConnected()) {
+		GPT_LOGE(STS, "Cannot send text, session is not connected");
+		return false;
+	}
+
+	GPTSpiJsonDocument doc;
+	doc["type"] = "conversation.item.create";
+	doc["item"]["type"] = "message";
+	doc["item"]["role"] = "user";
+	doc["item"]["content"][0]["type"] = "input_text";
+	doc["item"]["content"][0]["text"] = text.view();
+	if (!sendJson(doc)) {
 		return false;
 	}
 	doc.clear();
 
-	// trigger model to speak
+	// trigger model to answer, optionally without audio
 	doc["type"] = "response.create";
-	ESP_LOGI("STS", "Sending response.create: %s", toolCallback.output);
-	
-	return gptWebSocket->sendTXT(doc.as<String>().c_str());
+	lockConfig();
+	textOnly = textOnly || _sessionConfig.textOnly;
+	unlockConfig();
+	if (textOnly) {
+		doc["response"]["output_modalities"][0] = "text";
+	}
+
+	return sendJson(doc);
 }
 
 bool GPTStsService::start(
@@ -141,17 +519,22 @@ bool GPTStsService::start(
 	EventDisconnectCallback _eventDisconnectCallback
 	) {
 	if (!_initialized) {
-		ESP_LOGE("STS", "STS service not initialized");
+		GPT_LOGE(STS, "STS service not initialized");
 		return false;
 	}
 
 	if (_isStreaming) {
-		ESP_LOGW("STS", "Streaming already active");
+		GPT_LOGW(STS, "Streaming already active");
 		return true;
 	}
 
+	if (isSessionTask(xTaskGetCurrentTaskHandle())) {
+		GPT_LOGE(STS, "Cannot restart streaming from a session callback");
+		return false;
+	}
+
 	if (!WiFi.isConnected()) {
-		ESP_LOGE("STS", "No WiFi connection");
+		GPT_LOGE(STS, "No WiFi connection");
 		return false;
 	}
 
@@ -160,214 +543,280 @@ bool GPTStsService::start(
 	if(eventConnectedCallback) _eventConnectedCallback = eventConnectedCallback;
 	if(eventUpdatedCallback) _eventUpdatedCallback = eventUpdatedCallback;
 	if(eventFunctionCallback) _eventFunctionCallback = eventFunctionCallback;
+
+	// A session that ended on its own or by a deferred stop() is reaped first
+	joinStreamingTask();
+	if (_streamingExited == nullptr) {
+		_streamingExited = xSemaphoreCreateBinary();
+	}
 	_isStreaming = true;
 
+	_documentPool.warmUp();
+	startToolWorkers();
+
 	// Create streaming task
 	xTaskCreatePinnedToCore([](void* param) {
 		GPTStsService* service = static_cast<GPTStsService*>(param);
 		service->streamingTask();
-		vTaskDelete(service->_streamingTask);
+		xSemaphoreGive(service->_streamingExited);
+		vTaskDelete(NULL);
 	}, "STS_Streaming", 16384, this, 11, &_streamingTask, 1);
 
-	ESP_LOGI("STS", "Streaming started");
+	GPT_LOGI(STS, "Streaming started");
 	return true;
 }
 
 void GPTStsService::stop() {
-	if (!_isStreaming) {
+	if (_streamingTask == nullptr) {
 		return;
 	}
 
+	// The streaming task leaves its loop, stops the tool workers and exits,
+	// nothing is killed while it holds a lock or a pooled document
 	_isStreaming = false;
 	_isGPTSpeaking = false; // Reset speaking flag
 
-	if (_streamingTask != nullptr) {
-		vTaskDelete(_streamingTask);
-		_streamingTask = nullptr;
+	if (isSessionTask(xTaskGetCurrentTaskHandle())) {
+		GPT_LOGI(STS, "Streaming stop requested from a session callback");
+		return;
 	}
 
-	ESP_LOGI("STS", "Streaming stopped");
+	joinStreamingTask();
+	GPT_LOGI(STS, "Streaming stopped");
+}
+
+void GPTStsService::joinStreamingTask() {
+	if (_streamingTask == nullptr) {
+		return;
+	}
+	xSemaphoreTake(_streamingExited, portMAX_DELAY);
+	_streamingTask = nullptr;
+}
+
+bool GPTStsService::isSessionTask(TaskHandle_t task) const {
+	if (task == _streamingTask) {
+		return true;
+	}
+	for (size_t i = 0; i < GPT_STS_TOOL_WORKERS; i++) {
+		if (task == _toolWorkers[i]) {
+			return true;
+		}
+	}
+	return false;
 }
 
 void GPTStsService::streamingTask() {
-	bool sessionCreated = false;
+	_sessionCreated = false;
 	unsigned long wsLastLoop = 0;
 
 	// WebSocket event handler
-	gptWebSocket->onEvent([this, &sessionCreated](WStype_t type, uint8_t* payload, size_t length) {
+	gptWebSocket->onEvent([this](WStype_t type, uint8_t* payload, size_t length) {
 		switch (type) {
 			case WStype_CONNECTED:
-				ESP_LOGI("STS", "WebSocket connected for streaming");
-				sessionCreated = false;
+				GPT_LOGI(STS, "WebSocket connected for streaming");
+				_sessionCreated = false;
 				break;
 			case WStype_TEXT:
 				{
-					GPTSpiJsonDocument doc;
-					DeserializationError error = deserializeJson(doc, payload);
+					// Pooled document keeps its memory between messages
+					GPTJsonDocumentPool::Lease lease = _documentPool.lease();
+					JsonDocument& doc = *lease;
+					DeserializationError error = deserializeJson(doc, payload, length);
 					if (error) {
-						ESP_LOGE("STS", "Failed to parse WebSocket message: %s", error.c_str());
+						GPT_LOGE(STS, "Failed to parse WebSocket message: %s", error.c_str());
 						return;
 					}
 
-					String type = doc["type"] | "";
+					std::string_view type = doc["type"] | "";
 					if (type == "session.created") {
-						ESP_LOGI("STS", "Session created for streaming");
-						ESP_LOGI("STS", "%s", (char*)payload);
+						GPT_LOGI(STS, "Session created for streaming");
+						GPT_LOG_PAYLOAD(DEBUG, STS, "Session", payload, length);
 
 						// Send realtime session configuration
-						ESP_LOGI("STS", "Send session config");
-						String config = this->buildSessionConfig();
-						gptWebSocket->sendTXT(config);
+						GPT_LOGI(STS, "Send session config");
+						this->sendSessionConfig();
 
-						sessionCreated = true;
+						_sessionCreated = true;
 						if (_eventConnectedCallback) _eventConnectedCallback();
 					} else if (type == "session.updated") {
-						ESP_LOGI("STS", "Session updated");
+						GPT_LOGI(STS, "Session updated");
 						if (_eventUpdatedCallback) _eventUpdatedCallback((const char*) payload);
-					} else if (type == "response.audio.delta" && sessionCreated) {
+					} else if (type == "response.audio.delta" && _sessionCreated) {
 						// Received audio delta (base64 encoded)
-						String audioBase64 = doc["delta"] | "";
+						JsonString audioBase64 = doc["delta"];
 						// Decode base64 to audio data
-						std::vector<uint8_t> audioData = this->base64Decode(audioBase64);
+						this->base64Decode(std::string_view(audioBase64.c_str(), audioBase64.size()), _audioData);
 						if (_audioResponseCallback) {
-							_audioResponseCallback(audioData.data(), audioData.size(), false);
+							_audioResponseCallback((const uint8_t*) _audioData.c_str(), _audioData.length(), false);
 						}
-					} else if (type == "response.output_audio.delta" && sessionCreated) {
+					} else if (type == "response.output_audio.delta" && _sessionCreated) {
 						// Received output audio delta (base64 encoded)
-						String audioBase64 = doc["delta"] | "";
+						JsonString audioBase64 = doc["delta"];
 						// Decode base64 to audio data
-						std::vector<uint8_t> audioData = this->base64Decode(audioBase64);
+						this->base64Decode(std::string_view(audioBase64.c_str(), audioBase64.size()), _audioData);
 						if (_audioResponseCallback) {
-							_audioResponseCallback(audioData.data(), audioData.size(), false);
+							_audioResponseCallback((const uint8_t*) _audioData.c_str(), _audioData.length(), false);
 						}
-					} else if (type == "response.text.delta" && sessionCreated) {
-						String textDelta = doc["delta"] | "";
-						ESP_LOGI("STS", "Received text delta: %s", textDelta.c_str());
-					} else if (type == "response.output_audio_transcript.delta" && sessionCreated) {
-						String textDelta = doc["delta"] | "";
-						ESP_LOGD("STS", "Received output audio transcript delta: %s", textDelta.c_str());
-					} else if (type == "response.created" && sessionCreated) {
-						ESP_LOGI("STS", "Response created");
+					} else if ((type == "response.text.delta" || type == "response.output_text.delta") && _sessionCreated) {
+						GPT_LOGV(STS, "Received text delta");
+						this->emitTranscript(GPTTranscriptSource::GPT_OUTPUT_TEXT, doc["delta"], false);
+					} else if ((type == "response.text.done" || type == "response.output_text.done") && _sessionCreated) {
+						GPT_LOGD(STS, "Response text done");
+						this->emitTranscript(GPTTranscriptSource::GPT_OUTPUT_TEXT, doc["text"], true);
+					} else if (type == "response.output_audio_transcript.delta" && _sessionCreated) {
+						GPT_LOGV(STS, "Received output audio transcript delta");
+						this->emitTranscript(GPTTranscriptSource::GPT_OUTPUT_AUDIO, doc["delta"], false);
+					} else if (type == "response.created" && _sessionCreated) {
+						GPT_LOGI(STS, "Response created");
 						_isGPTSpeaking = true;
-					} else if (type == "response.output_item.added" && sessionCreated) {
-						ESP_LOGD("STS", "Response output item added");
-					} else if (type == "response.output_item.done" && sessionCreated) {
-						ESP_LOGI("STS", "Response output item done");
-					} else if (type == "response.content_part.added" && sessionCreated) {
-						ESP_LOGD("STS", "Response content part added");
-					} else if (type == "response.done" && sessionCreated) {
-						ESP_LOGD("STS", "Response completed");
+						xSemaphoreTake(_toolMutex, portMAX_DELAY);
+						_toolResponseDone = false;
+						xSemaphoreGive(_toolMutex);
+					} else if (type == "response.output_item.added" && _sessionCreated) {
+						GPT_LOGD(STS, "Response output item added");
+					} else if (type == "response.output_item.done" && _sessionCreated) {
+						GPT_LOGI(STS, "Response output item done");
+					} else if (type == "response.content_part.added" && _sessionCreated) {
+						GPT_LOGD(STS, "Response content part added");
+					} else if (type == "response.done" && _sessionCreated) {
+						GPT_LOGD(STS, "Response completed");
 						_isGPTSpeaking = false;
+						xSemaphoreTake(_toolMutex, portMAX_DELAY);
+						_toolResponseDone = true;
+						xSemaphoreGive(_toolMutex);
 						if (_audioResponseCallback) {
 							_audioResponseCallback(nullptr, 0, true); // Signal end of response
 						}
 					} else if (type == "response.function_call_arguments.delta") {
-						ESP_LOGD("STS", "Response function call arguments delta");
+						GPT_LOGV(STS, "Response function call arguments delta");
+						if (_eventFunctionCallback) {
+							this->appendToolArguments(doc["call_id"] | "", doc["delta"] | "");
+						}
 					} else if (type == "response.function_call_arguments.done") {
-						ESP_LOGI("STS", "Response function call arguments done: %s", (char*) payload);
+						GPT_LOG_PAYLOAD(DEBUG, STS, "Response function call arguments done", payload, length);
 						if (_eventFunctionCallback) {
-							GPTSpiJsonDocument params;
-							deserializeJson(params, doc["arguments"].as<String>());
-							_eventFunctionCallback(GPTToolCall{
-								.callId = doc["call_id"],
-								.name = doc["name"],
-								.params = params
-							});
-							params.clear();
+							// Executed on the tool worker pool, not in the socket callback
+							this->dispatchToolCall(doc);
 						}
 					} else if (type == "conversation.item.input_audio_transcription.delta") {
-						ESP_LOGD("STS", "Conversation item input audio delta transcription");
+						GPT_LOGV(STS, "Conversation item input audio delta transcription");
+						this->emitTranscript(GPTTranscriptSource::GPT_INPUT_AUDIO, doc["delta"], false);
 					} else if (type == "conversation.item.input_audio_transcription.completed") {
-						ESP_LOGD("STS", "Conversation item input audio delta transcription completed");
+						GPT_LOGD(STS, "Conversation item input audio delta transcription completed");
+						this->emitTranscript(GPTTranscriptSource::GPT_INPUT_AUDIO, doc["transcript"], true);
+					} else if (type == "conversation.item.input_audio_transcription.failed") {
+						String errorMsg = doc["error"]["message"] | "Unknown error";
+						GPT_LOGW(STS, "Input audio transcription failed: %s", errorMsg.c_str());
 					} else if (type == "conversation.item.added") {
-						ESP_LOGD("STS", "Conversation item added");
+						GPT_LOGD(STS, "Conversation item added");
 					} else if (type == "conversation.item.done") {
-						ESP_LOGD("STS", "Conversation item done");
+						GPT_LOGD(STS, "Conversation item done");
 					} else if (type == "input_audio_buffer.committed") {
-						ESP_LOGD("STS", "Input audio buffer committed");
+						GPT_LOGD(STS, "Input audio buffer committed");
 					} else if (type == "error") {
 						String errorMsg = doc["error"]["message"] | "Unknown error";
-						ESP_LOGE("STS", "WebSocket error: %s", errorMsg.c_str());
+						GPT_LOGE(STS, "WebSocket error: %s", errorMsg.c_str());
 					} else if (type == "input_audio_buffer.speech_started") {
-						ESP_LOGI("STS", "Speech started");
+						GPT_LOGI(STS, "Speech started");
 					} else if (type == "input_audio_buffer.speech_stopped") {
-						ESP_LOGI("STS", "Speech stopped - server will create response");
-					} else if (type == "response.output_audio.done" && sessionCreated) {
-						ESP_LOGD("STS", "Response output audio done");
-					} else if (type == "response.output_audio_transcript.done" && sessionCreated) {
-						ESP_LOGD("STS", "Response output audio transcript done");
-					} else if (type == "response.content_part.done" && sessionCreated) {
-						ESP_LOGD("STS", "Response content part done");
+						GPT_LOGI(STS, "Speech stopped - server will create response");
+					} else if (type == "response.output_audio.done" && _sessionCreated) {
+						GPT_LOGD(STS, "Response output audio done");
+					} else if (type == "response.output_audio_transcript.done" && _sessionCreated) {
+						GPT_LOGD(STS, "Response output audio transcript done");
+						this->emitTranscript(GPTTranscriptSource::GPT_OUTPUT_AUDIO, doc["transcript"], true);
+					} else if (type == "response.content_part.done" && _sessionCreated) {
+						GPT_LOGD(STS, "Response content part done");
 					} else if (type == "rate_limits.updated") {
-						ESP_LOGD("STS", "Rate limits updated");
+						GPT_LOGD(STS, "Rate limits updated");
 					} else {
-						ESP_LOGW("STS", "Unknown Response type: %s", type.c_str());
-						ESP_LOGW("STS", "%s", (char*)payload);
+						GPT_LOG_EVERY(WARN, STS, 5000, "Unknown Response type: %.*s", (int) type.size(), type.data());
+						GPT_LOG_PAYLOAD(DEBUG, STS, "Unknown response", payload, length);
 					}
 				}
 				break;
 			case WStype_BIN:
-				ESP_LOGW("STS", "Received binary message (%d bytes) - not handled", length);
+				GPT_LOG_EVERY(WARN, STS, 5000, "Received binary message (%d bytes) - not handled", length);
 				break;
 			case WStype_ERROR:
-				ESP_LOGE("STS", "WebSocket error occurred");
+				GPT_LOGE(STS, "WebSocket error occurred");
 				_isStreaming = false; // Stop streaming on error
 				break;
 			case WStype_FRAGMENT_TEXT_START:
 			case WStype_FRAGMENT_BIN_START:
 			case WStype_FRAGMENT:
 			case WStype_FRAGMENT_FIN:
-				ESP_LOGW("STS", "Received fragmented message - not handled");
+				GPT_LOG_EVERY(WARN, STS, 5000, "Received fragmented message - not handled");
 				break;
 			case WStype_PING:
-				ESP_LOGI("STS", "Received PING");
+				GPT_LOGV(STS, "Received PING");
 				break;
 			case WStype_PONG:
-				ESP_LOGI("STS", "Received PONG");
+				GPT_LOGV(STS, "Received PONG");
 				break;
 			case WStype_DISCONNECTED:
-				ESP_LOGI("STS", "WebSocket disconnected (sessionCreated: %d, _isStreaming: %d, reason: %.*s)", sessionCreated, _isStreaming, length, (char*)payload);
-				sessionCreated = false;
+				GPT_LOGI(STS, "WebSocket disconnected (sessionCreated: %d, _isStreaming: %d, reason: %.*s)", _sessionCreated, _isStreaming, length, (char*)payload);
+				_sessionCreated = false;
 				_isGPTSpeaking = false; // Reset speaking flag on disconnect
 				break;
 			default:
-				ESP_LOGW("STS", "Unknown WebSocket event type: %d", type);
+				GPT_LOG_EVERY(WARN, STS, 5000, "Unknown WebSocket event type: %d", type);
 				break;
 		}
 	});
 
 	// Connect to WebSocket
+	lockConfig();
 	String url = "/v1/realtime?model=" + _model;
-	String authHeader = "Bearer " + _apiKey;
+	unlockConfig();
+	// A session holds its key until it ends; the WebSocket library does not
+	// expose the handshake response, so the pool gets no feedback from it
+	String poolKey;
+	String authHeader = "Bearer " + (gptKeys->select(poolKey) >= 0 ? poolKey : _apiKey);
+	// The WebSocket library resolves the host on its own, gptDns is not used
 	gptWebSocket->beginSSL("api.openai.com", 443, url.c_str());
 	gptWebSocket->setAuthorization(authHeader.c_str());
 	gptWebSocket->setReconnectInterval(5000);
 
+	// The WebSocket library owns its socket and already disables Nagle,
+	// the realtime profile's keepalive maps onto WebSocket pings
+	constexpr GPTSocketOptions realtime = GPTSocketOptions::forProfile(GPTTransportProfile::GPT_REALTIME);
+	gptWebSocket->enableHeartbeat(realtime.keepIdle * 1000, realtime.keepInterval * 1000, realtime.keepCount);
+
 	// Main streaming loop
 	bool wsConnected = true;
 	const size_t bufferSize = 1536; 
 	uint8_t* buffer = (uint8_t*) heap_caps_malloc(bufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
 	while (_isStreaming) {
 		if (millis() - wsLastLoop > 10){
+			// Event handlers send from within loop(), the mutex is recursive
+			xSemaphoreTakeRecursive(_sendMutex, portMAX_DELAY);
 			gptWebSocket->loop();
+			xSemaphoreGiveRecursive(_sendMutex);
 			wsLastLoop = millis();
 			wsConnected = gptWebSocket->isConnected();
 		}
 
+		if (wsConnected && _sessionCreated) {
+			this->flushToolOutputs();
+		}
+
 		// Continuously send audio data if available (only when GPT is not speaking)
-		if (wsConnected && sessionCreated && !_isGPTSpeaking && _audioFillCallback) {
+		if (wsConnected && _sessionCreated && !_isGPTSpeaking && _audioFillCallback) {
 			size_t bytesRead = _audioFillCallback(buffer, bufferSize);
 
 			if (bytesRead > 0) {
-				ESP_LOGD("STS", "Sending %d bytes of audio data", bytesRead);
-				// Encode audio to base64 and send
-				String audioMessage = "{\"type\":\"input_audio_buffer.append\",\"audio\":\"" 
-					+ this->base64Encode(buffer, bytesRead) 
-					+ "\"}";
-
-				// Sometime string failure and return empty data
-				if (audioMessage.length() > 0)
-					gptWebSocket->sendTXT(audioMessage);
+				GPT_LOGV(STS, "Sending %d bytes of audio data", bytesRead);
+				// Encode audio to base64 into the reused message buffer and send
+				_audioMessage.clear();
+				_audioMessage.reserve(GPTBase64Encoder::encodedLength(bufferSize) + 64);
+				_audioMessage += "{\"type\":\"input_audio_buffer.append\",\"audio\":\"";
+				GPTBase64Encoder encoder(_audioMessage);
+				encoder.write(buffer, bytesRead);
+				encoder.finish();
+				_audioMessage += "\"}";
+
+				sendMessage(_audioMessage.c_str(), _audioMessage.length());
 			}
 
 			memset(buffer, 0, bufferSize);
@@ -377,47 +826,53 @@ void GPTStsService::streamingTask() {
 	}
 	heap_caps_free(buffer);
 
-	ESP_LOGI("STS", "Streaming loop exited (_isStreaming: %d)", _isStreaming);
+	GPT_LOGI(STS, "Streaming loop exited (_isStreaming: %d)", _isStreaming);
+	xSemaphoreTakeRecursive(_sendMutex, portMAX_DELAY);
 	gptWebSocket->disconnect();
-	ESP_LOGI("STS", "Streaming task ended");
+	xSemaphoreGiveRecursive(_sendMutex);
+	stopToolWorkers();
+	GPT_LOGI(STS, "Streaming task ended");
 	if (_eventDisconnectCallback) {
 		_eventDisconnectCallback();
 	}
 }
 
-String GPTStsService::base64Encode(const uint8_t* data, size_t length) {
-	// Simple base64 encoding implementation
-	static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	String encoded;
-	size_t i = 0;
-	uint32_t buffer = 0;
-	int bits = 0;
-
-	while (i < length || bits > 0) {
-		if (i < length) {
-			buffer = (buffer << 8) | data[i++];
-			bits += 8;
-		} else {
-			buffer <<= 8;
-			bits += 8;
-		}
+void GPTStsService::emitTranscript(GPTTranscriptSource source, JsonVariantConst text, bool isFinal) {
+	if (!_transcriptCallback) {
+		return;
+	}
 
-		while (bits >= 6) {
-			bits -= 6;
-			encoded += base64Chars[(buffer >> bits) & 0x3F];
-		}
+	// View straight into the parsed document, no String copy
+	JsonString str = text.as<JsonString>();
+	if (str.isNull()) {
+		return;
 	}
+	_transcriptCallback(source, std::string_view(str.c_str(), str.size()), isFinal);
+}
+
+bool GPTStsService::sendJson(const JsonDocument& doc) {
+	GPTString message;
+	message.reserve(measureJson(doc));
+	serializeJson(doc, message);
+	return sendMessage(message.c_str(), message.length());
+}
 
-	// Add padding
-	while (encoded.length() % 4 != 0) {
-		encoded += '=';
+bool GPTStsService::sendMessage(const char* message, size_t length) {
+	if (_sendMutex == nullptr) {
+		return false; // not initialized, no session to send on
 	}
+	xSemaphoreTakeRecursive(_sendMutex, portMAX_DELAY);
+	bool sent = gptWebSocket->sendTXT(message, length);
+	xSemaphoreGiveRecursive(_sendMutex);
+	return sent;
+}
 
-	return encoded;
+bool GPTStsService::Speak() {
+	static const char RESPONSE_CREATE[] = "{\"type\":\"response.create\"}";
+	return sendMessage(RESPONSE_CREATE, sizeof(RESPONSE_CREATE) - 1);
 }
 
-std::vector<uint8_t> GPTStsService::base64Decode(const String& input) {
-	std::vector<uint8_t> decoded;
+void GPTStsService::base64Decode(std::string_view input, GPTString& output) {
 	static const int base64Index[256] = {
 		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
 		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
@@ -437,10 +892,13 @@ std::vector<uint8_t> GPTStsService::base64Decode(const String& input) {
 		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
 	};
 
-	size_t length = input.length();
+	size_t length = input.size();
 	uint32_t buffer = 0;
 	int bits = 0;
 
+	output.clear();
+	output.reserve((length / 4) * 3);
+
 	for (size_t i = 0; i < length; ++i) {
 		char c = input[i];
 		if (c == '=') break; // Padding
@@ -453,15 +911,15 @@ std::vector<uint8_t> GPTStsService::base64Decode(const String& input) {
 
 		if (bits >= 8) {
 			bits -= 8;
-			decoded.push_back((buffer >> bits) & 0xFF);
+			output.append((char) ((buffer >> bits) & 0xFF));
 		}
 	}
-
-	return decoded;
 }
 
 std::vector<gpt_sts_t> GPTStsService::getAvailableModels() {
-	return std::vector<gpt_sts_t>(AVAILABLE_MODELS, AVAILABLE_MODELS + NUM_MODELS);
+	return gptCatalog->getModels(GPTModelCatalog::GPT_CATALOG_REALTIME, AVAILABLE_MODELS, NUM_MODELS);
 }
 
-GPTStsService aiSts;
\ No newline at end of file
+GPTStsService aiSts;
+
+#endif // GPT_ENABLE_STS
@@ -1,12 +1,36 @@
 #ifndef SPEECH_TO_SPEECH_SERVICE_H
 #define SPEECH_TO_SPEECH_SERVICE_H
 
+#include "config.h"
+
+#if !GPT_ENABLE_STS
+#error "sts.h is included but the service is disabled, see GPT_ENABLE_STS"
+#endif
+
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <deque>
 #include <functional>
+#include <string_view>
 #include <vector>
 #include <FS.h>
+#include <memory>
 #include <core.h>
+#include "schema.h"
+
+// Number of worker tasks executing tool calls in parallel
+#ifndef GPT_STS_TOOL_WORKERS
+#define GPT_STS_TOOL_WORKERS 2
+#endif
+
+#ifndef GPT_STS_TOOL_WORKER_STACK
+#define GPT_STS_TOOL_WORKER_STACK 8192
+#endif
+
+// Max time to wait for all tool outputs before the response is triggered anyway
+#ifndef GPT_STS_TOOL_TIMEOUT_MS
+#define GPT_STS_TOOL_TIMEOUT_MS 15000
+#endif
 
 typedef struct GPTStsModel {
 	const char* id;
@@ -19,18 +43,49 @@ typedef struct GPTStsModel {
 class GPTStsService {
 public:
 
-	// setup tool
+	// Realtime session configuration, serialized into session.update
+	struct SessionConfig {
+		String instructions =
+			"You are a calm, monotone AI assistant. "
+			"Speak in short, efficient sentences. "
+			"Avoid emotional language. "
+			"Report confidence or probability only when it is relevant. "
+			"Use dry, understated humor. "
+			"Maintain a robotic, professional tone at all times. "
+			"Include humor most of the time. "
+			"Include numeric confidence occasionally, but only if relevant. "
+			"If your answer is long, break it into multiple short statements.";
+		int maxOutputTokens = 1024;			// 0 for no limit ("inf")
+		bool textOnly = false;				// text output instead of audio
+		String voice = "shimmer";
+		int inputSampleRate = 24000;		// audio/pcm input rate
+		int outputSampleRate = 24000;		// audio/pcm output rate
+		String noiseReduction = "near_field";	// "near_field", "far_field" or empty to disable
+		String transcriptionModel = "gpt-4o-mini-transcribe";	// empty to disable input transcription
+		String turnDetection = "server_vad";	// "server_vad", "semantic_vad" or empty for manual turns
+		bool interruptResponse = false;
+		int prefixPaddingMs = 300;			// server_vad only
+		int silenceDurationMs = 3000;		// server_vad only
+		float vadThreshold = 0.5f;			// server_vad only
+		String toolChoice = "auto";
+	};
+
+	// setup tool, schema (flash JSON) takes precedence over params
 	struct GPTTool {
 		const char* description;
 		const char* name;
 		GPTSpiJsonDocument params;
+		const char* schema = nullptr;
 	};
 
-	// call the function
+	// call the function (move-only, callId and name point into storage,
+	// params into the pooled document)
 	struct GPTToolCall {
 		const char* callId;
 		const char* name;
-		GPTSpiJsonDocument params;
+		JsonVariantConst params;
+		std::unique_ptr<char[]> storage;
+		GPTJsonDocumentPool::Lease document;
 	};
 
 	// trigger ai model with output
@@ -41,6 +96,13 @@ public:
 		const char* status;
 	};
 	
+	// Origin of a transcript event
+	enum class GPTTranscriptSource {
+		GPT_INPUT_AUDIO,	// transcription of the user's speech
+		GPT_OUTPUT_AUDIO,	// transcript of the model's spoken response
+		GPT_OUTPUT_TEXT		// model text output
+	};
+
 	// Callback type for audio fill (provide audio data for streaming)
 	using AudioFillCallback = std::function<size_t(uint8_t* buffer, size_t maxSize)>;
 
@@ -53,6 +115,10 @@ public:
 	using EventFunctionCallback = std::function<void(const GPTToolCall&)>;
 	using EventDisconnectCallback = std::function<void(void)>;
 
+	// Callback type for transcript deltas and final transcripts.
+	// text points into the parsed event and is only valid during the call.
+	using TranscriptCallback = std::function<void(GPTTranscriptSource source, std::string_view text, bool isFinal)>;
+
 	GPTStsService();
 	~GPTStsService();
 
@@ -86,7 +152,9 @@ public:
 		);
 
 	/**
-	 * Stop the continuous streaming session
+	 * Stop the continuous streaming session and wait until it ended. Called
+	 * from a tool or event callback it only asks the session to end, since
+	 * the session waits for that callback.
 	 */
 	void stop();
 
@@ -97,39 +165,120 @@ public:
 	bool isStreaming() const { return _isStreaming; }
 
 	/**
-	 * Set STS model
+	 * Set STS model, used from the next session
 	 * @param model Model name
 	 */
-	void setModel(const String& model) { _model = model; }
+	void setModel(GPTText model);
 
 	/**
 	 * Set voice for TTS response
 	 * @param voice Voice name
 	 */
-	void setVoice(const String& voice) { _voice = voice; }
+	void setVoice(GPTText voice);
+
+	/**
+	 * Set callback for incremental and final transcripts
+	 * @param callback Transcript callback, nullptr to disable
+	 */
+	void setTranscriptCallback(TranscriptCallback callback) { _transcriptCallback = callback; }
 
 	/**
-	 * Get available STS models
+	 * Set session output to text only instead of audio
+	 * @param textOnly true for text-only responses
+	 */
+	void setTextOnly(bool textOnly);
+
+	/**
+	 * Get current session configuration
+	 * @return Session configuration
+	 */
+	const SessionConfig& getSessionConfig() const { return _sessionConfig; }
+
+	/**
+	 * Replace session configuration. While a session is open only the
+	 * fields that differ from the current configuration are sent.
+	 * @param config New session configuration
+	 * @return true if stored and, when connected, the update was sent
+	 */
+	bool setSessionConfig(const SessionConfig& config);
+
+	/**
+	 * Send a typed user message over the open realtime session
+	 * @param text User message (literal, view or String)
+	 * @param textOnly Request a text-only response for this message
+	 * @return true if the message and response request were sent
+	 */
+	bool sendText(GPTText text, bool textOnly = false);
+
+	/**
+	 * Get available STS models, checked against gptCatalog and
+	 * extended by it once it is loaded
 	 * @return Vector of available models
 	 */
 	static std::vector<gpt_sts_t> getAvailableModels();
 	
+	/**
+	 * Register a tool
+	 * @param tool Tool definition, moved into the registry
+	 */
+	void addTool(GPTTool&& tool);
 	void addTool(const GPTTool& tool);
+
+	/**
+	 * Register a tool whose parameter schema is generated at compile time
+	 * @tparam Params Struct declaring static constexpr GPTToolParam params[]
+	 * @param name Tool name
+	 * @param description Tool description
+	 */
+	template<typename Params>
+	void addTool(const char* name, const char* description) {
+		addTool(GPTTool{description, name, GPTSpiJsonDocument(), GPTToolSchema<Params>::json.data()});
+	}
+
+	/**
+	 * Send registered tools, serialized once and cached
+	 * @return true if sent
+	 */
 	bool sendTools();
+
+	/**
+	 * Queue a tool output. Outputs of all tool calls from one response are
+	 * sent together, followed by a single response.create.
+	 * Safe to call from tool worker tasks.
+	 * @param toolCallback Tool output
+	 * @return true if the output was queued
+	 */
 	bool sendToolCallback(const GPTToolCallback& toolCallback);
 
-	bool Speak() { return gptWebSocket->sendTXT("{\"type\":\"response.create\"}"); }
+	/**
+	 * Get utilisation of the pooled event documents
+	 * @return Pool statistics
+	 */
+	GPTJsonDocumentPool::Stats getDocumentPoolStats() const { return _documentPool.stats(); }
+
+	bool Speak();
 
 private:
 	String _apiKey;
 	String _model;
-	String _voice;
 	bool _initialized;
 
+	// Session configuration and its cached full serialization, written by
+	// the caller's task and read by the streaming task under _configMutex
+	SessionConfig _sessionConfig;
+	GPTString _sessionConfigCache;
+	SemaphoreHandle_t _configMutex;
+
+	// Pre-warmed documents for incoming events and tool calls
+	GPTJsonDocumentPool _documentPool;
+
 	// Streaming state
 	bool _isStreaming;
+	bool _sessionCreated;
 	bool _isGPTSpeaking;
 	TaskHandle_t _streamingTask;
+	SemaphoreHandle_t _streamingExited; // given by the streaming task when it ends
+	SemaphoreHandle_t _sendMutex; // recursive, held for socket sends and loop()
 
 	// callback
 	AudioFillCallback _audioFillCallback;
@@ -138,19 +287,73 @@ private:
 	EventUpdatedCallback _eventUpdatedCallback;
 	EventFunctionCallback _eventFunctionCallback;
 	EventDisconnectCallback _eventDisconnectCallback;
-	std::vector<GPTTool> _tools;
+	TranscriptCallback _transcriptCallback;
+	std::deque<GPTTool> _tools;
+	GPTString _toolsCache;
+
+	// Tool call arguments accumulated from delta events
+	struct PendingArguments {
+		String callId;
+		GPTString arguments;
+	};
+	std::vector<PendingArguments> _pendingArguments;
+
+	// Tool execution pool and batched outputs
+	QueueHandle_t _toolQueue;
+	TaskHandle_t _toolWorkers[GPT_STS_TOOL_WORKERS];
+	SemaphoreHandle_t _toolMutex;
+	SemaphoreHandle_t _toolWorkersExited; // given by each worker that stopped
+	std::vector<GPTString> _toolOutputs;
+	size_t _pendingToolCalls;
+	bool _toolResponseDone;
+	unsigned long _toolDeadline;
 
 	// Continuous streaming task
 	void streamingTask();
 
-	// Build session configuration JSON
-	String buildSessionConfig();
+	// Wait for a streaming task that ended or is ending
+	void joinStreamingTask();
+
+	// The streaming task or a tool worker, which stop() must not wait on
+	bool isSessionTask(TaskHandle_t task) const;
+
+	// Tool worker task
+	void toolWorkerTask();
+	void startToolWorkers();
+	void stopToolWorkers();
+
+	// Accumulate and dispatch tool calls
+	void appendToolArguments(const char* callId, const char* delta);
+	void dispatchToolCall(JsonDocument& event);
+
+	// Send queued tool outputs once every call of the response has answered
+	void flushToolOutputs();
+
+	// Forward a transcript field of an event to the transcript callback
+	void emitTranscript(GPTTranscriptSource source, JsonVariantConst text, bool isFinal);
+
+	// Send the full session.update message, serialized once and cached
+	bool sendSessionConfig();
+
+	// Take and give _configMutex, a no-op before init()
+	void lockConfig();
+	void unlockConfig();
+
+	// Write session fields, only those differing from previous when given
+	size_t writeSessionConfig(JsonObject session, const SessionConfig& config, const SessionConfig* previous = nullptr);
+
+	// Reused buffers for outgoing audio messages and decoded audio deltas
+	GPTString _audioMessage;
+	GPTString _audioData;
+
+	// Serialize a control message and send it
+	bool sendJson(const JsonDocument& doc);
 
-	// Encode audio to base64 for WebSocket
-	String base64Encode(const uint8_t* data, size_t length);
+	// Send on the socket under _sendMutex; tool callbacks run on worker tasks
+	bool sendMessage(const char* message, size_t length);
 
-	// Decode base64 audio from WebSocket
-	std::vector<uint8_t> base64Decode(const String& input);
+	// Decode base64 audio from WebSocket, replacing the content of output
+	void base64Decode(std::string_view input, GPTString& output);
 };
 
 extern GPTStsService aiSts;
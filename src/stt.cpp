@@ -1,3 +1,6 @@
+#include "config.h"
+
+#if GPT_ENABLE_STT
 #include "stt.h"
 #include <WiFiClientSecure.h>
 #include <WiFi.h>
@@ -27,7 +30,7 @@ GPTSttService::~GPTSttService() {
 
 bool GPTSttService::init(const String& apiKey, fs::FS& fs) {
 	if (apiKey.length() == 0) {
-		ESP_LOGE("TRANSCRIPTION", "API key is empty");
+		GPT_LOGE(STT, "API key is empty");
 		return false;
 	}
 
@@ -35,138 +38,160 @@ bool GPTSttService::init(const String& apiKey, fs::FS& fs) {
 	_fs = &fs;
 	_initialized = true;
 
-	ESP_LOGI("TRANSCRIPTION", "Transcription service initialized with model: %s", _model.c_str());
+	GPT_LOGI(STT, "Transcription service initialized with model: %s", _model.c_str());
 	return true;
 }
 
-String GPTSttService::buildMultipartPayload(const String& filePath, const String& boundary) {
-	String payload = "";
+struct GPTSttService::Request {
+	GPTSttService* service;
+	String filePath;
+	String model;
+	String boundary;
+	TranscriptionCallback callback;
+};
 
-	// Add file part
-	payload += "--" + boundary + "\r\n";
-	payload += "Content-Disposition: form-data; name=\"file\"; filename=\"" + filePath.substring(filePath.lastIndexOf('/') + 1) + "\"\r\n";
-	payload += "Content-Type: audio/wav\r\n\r\n";
+GPTString GPTSttService::buildMultipartHead(const String& filePath, const String& boundary) {
+	GPTString head;
 
-	// Read file content
-	File file = _fs->open(filePath, "r");
-	if (!file) {
-		ESP_LOGE("TRANSCRIPTION", "Failed to open file: %s", filePath.c_str());
-		return "";
-	}
+	// Add file part, the file content follows
+	head += "--";
+	head += boundary;
+	head += "\r\n";
+	head += "Content-Disposition: form-data; name=\"file\"; filename=\"";
+	head += filePath.c_str() + filePath.lastIndexOf('/') + 1;
+	head += "\"\r\n";
+	head += "Content-Type: audio/wav\r\n\r\n";
 
-	int bufferSize = 1024 * 100;
-	uint8_t* buffer = (uint8_t*) heap_caps_malloc(bufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_DEFAULT);
-	if (!buffer) {
-		ESP_LOGE("TRANSCRIPTION", "Failed to allocate memory for file content");
-		file.close();
-		return "";
-	}
-	
-	while (file.available()) {
-		size_t bytes = file.read(buffer, bufferSize);
-		payload += String((const char*) buffer, bytes);
-	}
-	delete[] buffer;
-	file.close();
+	return head;
+}
 
-	payload += "\r\n";
+GPTString GPTSttService::buildMultipartTail(const String& model, const String& boundary) {
+	GPTString tail;
+
+	tail += "\r\n";
 
 	// Add model part
-	payload += "--" + boundary + "\r\n";
-	payload += "Content-Disposition: form-data; name=\"model\"\r\n\r\n";
-	payload += _model + "\r\n";
+	tail += "--";
+	tail += boundary;
+	tail += "\r\n";
+	tail += "Content-Disposition: form-data; name=\"model\"\r\n\r\n";
+	tail += model;
+	tail += "\r\n";
 
 	// End boundary
-	payload += "--" + boundary + "--\r\n";
+	tail += "--";
+	tail += boundary;
+	tail += "--\r\n";
 
-	return payload;
+	return tail;
 }
 
-void GPTSttService::transcribeAudio(const String& filePath, TranscriptionCallback callback) {
-	transcribeAudio(filePath, _model, callback);
+void GPTSttService::transcribeAudio(GPTText filePath, TranscriptionCallback callback) {
+	transcribeAudio(std::move(filePath), _model, callback);
 }
 
-void GPTSttService::transcribeAudio(const String& filePath, const String& model, TranscriptionCallback callback) {
+void GPTSttService::transcribeAudio(GPTText path, GPTText model, TranscriptionCallback callback) {
+	// The filesystem needs a terminated path and the callback gets it back
+	String filePath = path.release();
+
 	if (!_initialized) {
-		ESP_LOGE("TRANSCRIPTION", "Transcription service not initialized");
+		GPT_LOGE(STT, "Transcription service not initialized");
 		callback(filePath, "", "{}");
 		return;
 	}
 
 	if (!WiFi.isConnected()) {
-		ESP_LOGE("TRANSCRIPTION", "No WiFi connection");
+		GPT_LOGE(STT, "No WiFi connection");
 		callback(filePath, "", "{}");
 		return;
 	}
 
 	// Check if file exists
 	if (!_fs->exists(filePath)) {
-		ESP_LOGE("TRANSCRIPTION", "Audio file does not exist: %s", filePath.c_str());
+		GPT_LOGE(STT, "Audio file does not exist: %s", filePath.c_str());
 		callback(filePath, "", "{}");
 		return;
 	}
 
-	// Set model for this request
-	String originalModel = _model;
-	_model = model;
-
 	// Generate boundary
 	String boundary = "----ESP32FormBoundary" + String(random(1000000));
 
-	// Build multipart payload
-	String multipartPayload = buildMultipartPayload(filePath, boundary);
-	if (multipartPayload.length() == 0) {
-		ESP_LOGE("TRANSCRIPTION", "Failed to build multipart payload");
-		_model = originalModel;
-		callback(filePath, "", "{}");
-		return;
-	}
-
-	// Restore original model
-	_model = originalModel;
+	// The file is streamed into the connection by the request task
+	Request* request = new Request{this, std::move(filePath), model.release(), std::move(boundary), callback};
 
 	// Create async task for HTTP request
 	xTaskCreatePinnedToCore([](void* param) {
-		auto* params = static_cast<std::tuple<GPTSttService*, String, String, String, TranscriptionCallback>*>(param);
-		auto& [service, payload, file, bnd, cb] = *params;
+		Request* request = static_cast<Request*>(param);
+		GPTSttService* service = request->service;
+		const String& file = request->filePath;
+		TranscriptionCallback& cb = request->callback;
+
+		File audio = service->_fs->open(file, "r");
+		if (!audio) {
+			GPT_LOGE(STT, "Failed to open file: %s", file.c_str());
+			cb(file, "", "{}");
+			delete request;
+			vTaskDelete(NULL);
+			return;
+		}
+
+		GPTString head = service->buildMultipartHead(file, request->boundary);
+		GPTString tail = service->buildMultipartTail(request->model, request->boundary);
+		size_t audioSize = audio.size();
 
+		gptHttp->acquire(); // wait for the request of another service to finish
 		gptWifiClient->setInsecure(); // For HTTPS without certificate validation
 		gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/audio/transcriptions");
-    gptHttp->setReuse(false);
-		gptHttp->addHeader("Content-Type", "multipart/form-data; boundary=" + bnd);
-		gptHttp->addHeader("Authorization", "Bearer " + service->_apiKey);
+		gptHttp->setReuse(true); // the reply is read by length, keep the TLS session
+		gptHttp->addHeader("Content-Type", "multipart/form-data; boundary=" + request->boundary);
+		gptHttp->addAuthorization(service->_apiKey); // next key of gptKeys, if any
 		gptHttp->setTimeout(30000); // 30 second timeout
+		gptHttp->setTransportProfile(GPTTransportProfile::GPT_BULK); // file upload, throughput bound
+		gptHttp->setAcceptEncoding(true); // JSON replies compress well
+
+		GPT_LOGI(STT, "Sending transcription request to OpenAI API (file: %s, model: %s)...", file.c_str(), request->model.c_str());
+
+		// Multipart head, file content and tail go through the TX buffer
+		int httpCode = gptHttp->beginBody("POST", head.length() + audioSize + tail.length());
+		if (httpCode == 0) {
+			gptHttp->writeBody((const uint8_t*) head.c_str(), head.length());
+			gptHttp->writeBody(audio, audioSize);
+			gptHttp->writeBody((const uint8_t*) tail.c_str(), tail.length());
+			httpCode = gptHttp->endBody();
+		}
+		audio.close();
 
-		ESP_LOGI("TRANSCRIPTION", "Sending transcription request to OpenAI API...");
-		ESP_LOGI("TRANSCRIPTION", "File: %s", file.c_str());
-		ESP_LOGI("TRANSCRIPTION", "Model: %s", service->_model.c_str());
+		GPTString response;
+		if (httpCode > 0) {
+			gptHttp->getBody(response);
+		}
 
-		int httpCode = gptHttp->POST(payload);
+		// Free the connection before any user code runs, a callback may
+		// start the next request
+		gptHttp->end();
+		gptHttp->release();
 
 		if (httpCode == 200) {
-			String response = gptHttp->getString();
-			ESP_LOGI("TRANSCRIPTION", "Transcription successful");
-			service->processResponse(httpCode, response, file, cb);
+			GPT_LOGI(STT, "Transcription successful");
 		} else {
-			String response = gptHttp->getString();
-			ESP_LOGE("TRANSCRIPTION", "API returned error code: %d", httpCode);
-			service->processResponse(httpCode, response, file, cb);
+			GPT_LOGE(STT, "API returned error code: %d", httpCode);
 		}
+		GPTArenaAllocator arena;
+		service->processResponse(httpCode, response, file, cb, &arena);
 
-		gptHttp->end();
-		delete params;
-		params = nullptr;
+		delete request;
+		request = nullptr;
 		vTaskDelete(NULL);
-	}, "Transcription_Request", 16384, new std::tuple<GPTSttService*, String, String, String, TranscriptionCallback>(this, multipartPayload, filePath, boundary, callback), 1, NULL, 0);
+	}, "Transcription_Request", 16384, request, 1, NULL, 0);
 }
 
-void GPTSttService::processResponse(int httpCode, const String& response, const String& filePath, TranscriptionCallback callback) {
+void GPTSttService::processResponse(int httpCode, const GPTString& response, const String& filePath, TranscriptionCallback callback, ArduinoJson::Allocator* allocator) {
 	if (httpCode == 200) {
-		JsonDocument doc;
-		DeserializationError error = deserializeJson(doc, response);
+		JsonDocument doc(allocator);
+		DeserializationError error = deserializeJson(doc, response.c_str(), response.length());
 
 		if (error) {
-			ESP_LOGE("TRANSCRIPTION", "Failed to parse JSON response: %s", error.c_str());
+			GPT_LOGE(STT, "Failed to parse JSON response: %s", error.c_str());
 			callback(filePath, "", "{}");
 			return;
 		}
@@ -175,18 +200,18 @@ void GPTSttService::processResponse(int httpCode, const String& response, const
 		String usageJson;
 		serializeJson(doc["usage"], usageJson);
 
-		ESP_LOGI("TRANSCRIPTION", "Transcription: %s", transcription.c_str());
+		GPT_LOG_PAYLOAD(DEBUG, STT, "Transcription", transcription.c_str(), transcription.length());
 		callback(filePath, transcription, usageJson);
 		usageJson.clear();
 	} else {
-		ESP_LOGE("TRANSCRIPTION", "Transcription failed with code: %d", httpCode);
+		GPT_LOGE(STT, "Transcription failed with code: %d", httpCode);
 
 		// Try to extract error message
-		JsonDocument errorDoc;
-		if (deserializeJson(errorDoc, response) == DeserializationError::Ok) {
+		JsonDocument errorDoc(allocator);
+		if (deserializeJson(errorDoc, response.c_str(), response.length()) == DeserializationError::Ok) {
 			if (errorDoc["error"].is<JsonObject>()) {
 				String errorMsg = errorDoc["error"]["message"] | "Unknown API error";
-				ESP_LOGE("TRANSCRIPTION", "API Error: %s", errorMsg.c_str());
+				GPT_LOGE(STT, "API Error: %s", errorMsg.c_str());
 			}
 		}
 
@@ -195,7 +220,9 @@ void GPTSttService::processResponse(int httpCode, const String& response, const
 }
 
 std::vector<gpt_transcription_t> GPTSttService::getAvailableModels() {
-	return std::vector<gpt_transcription_t>(AVAILABLE_MODELS, AVAILABLE_MODELS + NUM_MODELS);
+	return gptCatalog->getModels(GPTModelCatalog::GPT_CATALOG_TRANSCRIPTION, AVAILABLE_MODELS, NUM_MODELS);
 }
 
-GPTSttService aiStt;
\ No newline at end of file
+GPTSttService aiStt;
+
+#endif // GPT_ENABLE_STT
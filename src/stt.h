@@ -1,12 +1,20 @@
 #ifndef TRANSCRIPTION_SERVICE_H
 #define TRANSCRIPTION_SERVICE_H
 
+#include "config.h"
+
+#if !GPT_ENABLE_STT
+#error "stt.h is included but the service is disabled, see GPT_ENABLE_STT"
+#endif
+
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <functional>
+#include <string_view>
 #include <vector>
 #include <FS.h>
+#include "core.h"
 
 typedef struct GPTSttModel {
 	const char* id;
@@ -40,10 +48,10 @@ public:
 
 	/**
 	 * Transcribe audio file
-	 * @param filePath Path to audio file (WAV format)
+	 * @param filePath Path to audio file (WAV format; rvalue Strings are moved)
 	 * @param callback Transcription callback
 	 */
-	void transcribeAudio(const String& filePath, TranscriptionCallback callback);
+	void transcribeAudio(GPTText filePath, TranscriptionCallback callback);
 
 	/**
 	 * Transcribe audio file with specific model
@@ -51,16 +59,17 @@ public:
 	 * @param model Model to use
 	 * @param callback Transcription callback
 	 */
-	void transcribeAudio(const String& filePath, const String& model, TranscriptionCallback callback);
+	void transcribeAudio(GPTText filePath, GPTText model, TranscriptionCallback callback);
 
 	/**
 	 * Set transcription model
 	 * @param model Model name
 	 */
-	void setModel(const String& model) { _model = model; }
+	void setModel(GPTText model) { _model = model.release(); }
 
 	/**
-	 * Get available transcription models
+	 * Get available transcription models, checked against gptCatalog
+	 * and extended by it once it is loaded
 	 * @return Vector of available models
 	 */
 	static std::vector<gpt_transcription_t> getAvailableModels();
@@ -72,10 +81,14 @@ private:
 	fs::FS* _fs;
 
 	// Process API response
-	void processResponse(int httpCode, const String& response, const String& filePath, TranscriptionCallback callback);
+	void processResponse(int httpCode, const GPTString& response, const String& filePath, TranscriptionCallback callback, ArduinoJson::Allocator* allocator);
+
+	// Request handed to the HTTP task
+	struct Request;
 
-	// Build multipart form data
-	String buildMultipartPayload(const String& filePath, const String& boundary);
+	// Build the multipart form data around the streamed file content
+	GPTString buildMultipartHead(const String& filePath, const String& boundary);
+	GPTString buildMultipartTail(const String& model, const String& boundary);
 };
 
 extern GPTSttService aiStt;
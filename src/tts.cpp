@@ -1,3 +1,6 @@
+#include "config.h"
+
+#if GPT_ENABLE_TTS
 #include "tts.h"
 #include <WiFiClientSecure.h>
 #include <WiFi.h>
@@ -26,6 +29,19 @@ static const GPTTtsVoice AVAILABLE_VOICES[] = {
 
 static const size_t NUM_VOICES = sizeof(AVAILABLE_VOICES) / sizeof(AVAILABLE_VOICES[0]);
 
+template<typename CallbackType>
+struct GPTTtsService::Request {
+	GPTTtsService* service;
+	GPTArenaAllocator arena;
+	JsonDocument payload;
+	String text;
+	CallbackType callback;
+	bool streaming;
+
+	Request(GPTTtsService* service, String&& text, CallbackType callback, bool streaming)
+		: service(service), payload(&arena), text(std::move(text)), callback(callback), streaming(streaming) {}
+};
+
 GPTTtsService::GPTTtsService()
 	: _model("gpt-4o-mini-tts")
 	, _voice("shimmer")
@@ -40,85 +56,81 @@ GPTTtsService::~GPTTtsService() {
 
 bool GPTTtsService::init(const String& apiKey) {
 	if (apiKey.length() == 0) {
-		ESP_LOGE("TTS", "API key is empty");
+		GPT_LOGE(TTS, "API key is empty");
 		return false;
 	}
 
 	_apiKey = apiKey;
 	_initialized = true;
 
-	ESP_LOGI("TTS", "TTS service initialized with model: %s, voice: %s", _model.c_str(), _voice.c_str());
+	GPT_LOGI(TTS, "TTS service initialized with model: %s, voice: %s", _model.c_str(), _voice.c_str());
 	return true;
 }
 
-String GPTTtsService::buildJsonPayload(const String& text) {
-	JsonDocument doc;
-
+void GPTTtsService::buildJsonPayload(JsonDocument& doc, std::string_view text, std::string_view voice) {
 	doc["model"] = _model;
 	doc["input"] = text;
-	doc["voice"] = _voice;
+	doc["voice"] = voice;
 	doc["response_format"] = formatToString(_format);
 	doc["instructions"] = "Speak softly with warmth, like a small robot chatting with a close friend late in the afternoon. The tone is relaxed, caring, and familiar. Use gentle pauses and light conversational fillers, naturally.";
-
-	String jsonString;
-	serializeJson(doc, jsonString);
-	return jsonString;
 }
 
 template<typename CallbackType>
-void GPTTtsService::performTtsRequest(const String& text, const String& voice, CallbackType callback, bool isStreaming) {
+void GPTTtsService::performTtsRequest(GPTText text, GPTText voice, CallbackType callback, bool isStreaming) {
 	if (!_initialized) {
-		ESP_LOGE("TTS", "TTS service not initialized");
+		GPT_LOGE(TTS, "TTS service not initialized");
 		if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
-			callback(text, nullptr, 0);
+			callback(text.release(), nullptr, 0);
 		} else {
-			callback(text, nullptr, 0, true);
+			callback(text.release(), nullptr, 0, true);
 		}
 		return;
 	}
 
 	if (!WiFi.isConnected()) {
-		ESP_LOGE("TTS", "No WiFi connection");
+		GPT_LOGE(TTS, "No WiFi connection");
 		if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
-			callback(text, nullptr, 0);
+			callback(text.release(), nullptr, 0);
 		} else {
-			callback(text, nullptr, 0, true);
+			callback(text.release(), nullptr, 0, true);
 		}
 		return;
 	}
 
-	if (text.length() == 0) {
-		ESP_LOGE("TTS", "Text is empty");
+	if (text.isEmpty()) {
+		GPT_LOGE(TTS, "Text is empty");
 		if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
-			callback(text, nullptr, 0);
+			callback(text.release(), nullptr, 0);
 		} else {
-			callback(text, nullptr, 0, true);
+			callback(text.release(), nullptr, 0, true);
 		}
 		return;
 	}
 
-	// Set voice for this request
-	String originalVoice = _voice;
-	_voice = voice;
-
-	// Build JSON payload
-	String jsonPayload = buildJsonPayload(text);
-
-	// Restore original voice
-	_voice = originalVoice;
+	// Build JSON document with the voice of this request, it is serialized
+	// into the connection by the request task
+	Request<CallbackType>* request = new Request<CallbackType>(this, String(), callback, isStreaming);
+	buildJsonPayload(request->payload, text.view(), voice.view());
+	request->text = text.release();
 
 	// Create async task for HTTP request
 	xTaskCreatePinnedToCore([](void* param) {
-		auto* params = static_cast<std::tuple<GPTTtsService*, String, String, CallbackType, bool>*>(param);
-		auto& [service, payload, txt, cb, streaming] = *params;
+		auto* request = static_cast<Request<CallbackType>*>(param);
+		GPTTtsService* service = request->service;
+		const String& txt = request->text;
+		CallbackType& cb = request->callback;
+		bool streaming = request->streaming;
 
+		gptHttp->acquire(); // wait for the request of another service to finish
 		gptWifiClient->setInsecure(); // For HTTPS without certificate validation
 		gptHttp->begin(*gptWifiClient, "https://api.openai.com/v1/audio/speech");
-		gptHttp->setReuse(false);
+		gptHttp->setReuse(false); // audio is read until the server closes
 		gptHttp->addHeader("Content-Type", "application/json");
 		gptHttp->addHeader("Accept", "*/*");
-		gptHttp->addHeader("Authorization", "Bearer " + service->_apiKey);
+		gptHttp->addAuthorization(service->_apiKey); // next key of gptKeys, if any
 		gptHttp->setTimeout(30000); // 30 second timeout
+		gptHttp->setTransportProfile(GPTTransportProfile::GPT_INTERACTIVE); // audio is played as it arrives
+		gptHttp->setAcceptEncoding(false); // audio is read straight from the stream
 
 		// Collect response headers
 		const char* headerKeys[] = {
@@ -129,23 +141,14 @@ void GPTTtsService::performTtsRequest(const String& text, const String& voice, C
 		};
 		gptHttp->collectHeaders(headerKeys, sizeof(headerKeys)/sizeof(headerKeys[0]));
 
-		// Print all headers being sent
-		ESP_LOGI("TTS", "=== TTS Request Headers ===");
-		ESP_LOGI("TTS", "Content-Type: application/json");
-		ESP_LOGI("TTS", "Accept: */*");
-		ESP_LOGI("TTS", "Authorization: Bearer [REDACTED]");
-		ESP_LOGI("TTS", "URL: https://api.openai.com/v1/audio/speech");
-		ESP_LOGI("TTS", "Payload: %s", payload.c_str());
-		ESP_LOGI("TTS", "==========================");
-
-		if (streaming) {
-			ESP_LOGI("TTS", "Sending streaming TTS request to OpenAI API...");
-		} else {
-			ESP_LOGI("TTS", "Sending TTS request to OpenAI API...");
-		}
+		GPT_LOGI(TTS, "Sending %sTTS request to OpenAI API...", streaming ? "streaming " : "");
+		GPT_LOG_JSON(DEBUG, TTS, "Payload", request->payload);
 
-		int httpCode = gptHttp->POST(payload);
+		int httpCode = gptHttp->sendJson("POST", request->payload);
 
+		// Non-streaming audio is collected and handed over after the
+		// connection is released
+		std::vector<uint8_t> audioData;
 		if (httpCode == 200) {
 			// Handle audio data based on streaming mode
 			WiFiClient* stream = gptHttp->getStreamPtr();
@@ -153,9 +156,9 @@ void GPTTtsService::performTtsRequest(const String& text, const String& voice, C
 			
 			
 			if (streaming) {
-				ESP_LOGI("TTS", "Starting to stream audio data");
+				GPT_LOGI(TTS, "Starting to stream audio data");
 			} else {
-				ESP_LOGI("TTS", "Starting to read audio data (Content-Length: %d)", contentLength);
+				GPT_LOGI(TTS, "Starting to read audio data (Content-Length: %d)", contentLength);
 			}
 			
 			const size_t BUFFER_SIZE = 64 * 1024;
@@ -163,25 +166,20 @@ void GPTTtsService::performTtsRequest(const String& text, const String& voice, C
 			size_t totalBytesProcessed = 0;
 			if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
 				// For non-streaming, accumulate all data
-				std::vector<uint8_t> audioData;
-				
 				while (stream->connected()) {
 					size_t bytesRead = stream->readBytes(buffer, BUFFER_SIZE);
 					
 					if (bytesRead > 0) {
 						audioData.insert(audioData.end(), buffer, buffer + bytesRead);
 						totalBytesProcessed += bytesRead;
-						ESP_LOGD("TTS", "Read %d bytes, total: %d", bytesRead, totalBytesProcessed);
+						GPT_LOGV(TTS, "Read %d bytes, total: %d", bytesRead, totalBytesProcessed);
 					}
 					
 					taskYIELD();
 				}
 				
-				if (totalBytesProcessed > 0) {
-					cb(txt, audioData.data(), totalBytesProcessed);
-				} else {
-					ESP_LOGE("TTS", "No audio data received");
-					cb(txt, nullptr, 0);
+				if (totalBytesProcessed == 0) {
+					GPT_LOGE(TTS, "No audio data received");
 				}
 
 			} else {
@@ -196,63 +194,66 @@ void GPTTtsService::performTtsRequest(const String& text, const String& voice, C
 						totalBytesProcessed += bytesRead;
 						// Send the chunk immediately without accumulation
 						cb(txt, buffer, bytesRead, false);
-						ESP_LOGD("TTS", "Sent chunk (%d bytes)", bytesRead);
+						GPT_LOGV(TTS, "Sent chunk (%d bytes)", bytesRead);
 					}
 					
 					taskYIELD();
 				}
-
-				cb(txt, nullptr, 0, true);
 			}
 			
 			heap_caps_free(buffer);
 		} else {
-			String response = gptHttp->getString();
-			ESP_LOGE("TTS", "API returned error code: %d", httpCode);
+			GPTString response;
+			gptHttp->getBody(response);
+			GPT_LOGE(TTS, "API returned error code: %d", httpCode);
 
-			JsonDocument errorDoc;
-			if (deserializeJson(errorDoc, response) == DeserializationError::Ok) {
+			GPTArenaAllocator arena;
+			JsonDocument errorDoc(&arena);
+			if (deserializeJson(errorDoc, response.c_str(), response.length()) == DeserializationError::Ok) {
 				if (errorDoc["error"].is<JsonObject>()) {
 					String errorMsg = errorDoc["error"]["message"] | "Unknown API error";
-					ESP_LOGE("TTS", "API Error: %s", errorMsg.c_str());
+					GPT_LOGE(TTS, "API Error: %s", errorMsg.c_str());
 				}
 			}
-
-			if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
-				cb(txt, nullptr, 0);
-			} else {
-				cb(txt, nullptr, 0, true);
-			}
 		}
 		
-		// Get all collected headers
-		for(int i = 0; i < gptHttp->headers(); i++) {
-			String headerName = gptHttp->headerName(i);
-			String headerValue = gptHttp->header(i);
-			ESP_LOGI("TTS", "%s: %s", headerName.c_str(), headerValue.c_str());
+		// Collected response headers, the loop is compiled out with the log
+		if (GPT_LOG_ENABLED(TTS, VERBOSE)) {
+			for (int i = 0; i < gptHttp->headers(); i++) {
+				GPT_LOGV(TTS, "%s: %s", gptHttp->headerName(i).c_str(), gptHttp->header(i).c_str());
+			}
 		}
 
+		// Free the connection before the final callback, it may start the next request
 		gptHttp->end();
-		delete params;
-		params = nullptr;
+		gptHttp->release();
+
+		if constexpr (std::is_same_v<CallbackType, AudioCallback>) {
+			cb(txt, audioData.empty() ? nullptr : audioData.data(), audioData.size());
+		} else {
+			cb(txt, nullptr, 0, true);
+		}
+
+		delete request;
+		request = nullptr;
 		vTaskDelete(NULL);
-	}, isStreaming ? "TTS_Stream_Request" : "TTS_Request", 16384, new std::tuple<GPTTtsService*, String, String, CallbackType, bool>(this, jsonPayload, text, callback, isStreaming), 15, NULL, 0);
+	}, isStreaming ? "TTS_Stream_Request" : "TTS_Request", 16384, request, 15, NULL, 0);
 }
 
-void GPTTtsService::textToSpeech(const String& text, AudioCallback callback) {
-	textToSpeech(text, _voice, callback);
+void GPTTtsService::textToSpeech(GPTText text, AudioCallback callback) {
+	textToSpeech(std::move(text), _voice, callback);
 }
 
-void GPTTtsService::textToSpeech(const String& text, const String& voice, AudioCallback callback) {
-	performTtsRequest(text, voice, callback, false);
+void GPTTtsService::textToSpeech(GPTText text, GPTText voice, AudioCallback callback) {
+	performTtsRequest(std::move(text), std::move(voice), callback, false);
 }
 
-void GPTTtsService::textToSpeechStream(const String& text, StreamCallback callback) {
-	textToSpeechStream(text, _voice, callback);
+void GPTTtsService::textToSpeechStream(GPTText text, StreamCallback callback) {
+	textToSpeechStream(std::move(text), _voice, callback);
 }
 
-void GPTTtsService::textToSpeechStream(const String& text, const String& voice, StreamCallback callback) {
-	performTtsRequest(text, voice, callback, true);
+void GPTTtsService::textToSpeechStream(GPTText text, GPTText voice, StreamCallback callback) {
+	performTtsRequest(std::move(text), std::move(voice), callback, true);
 }
 
 void GPTTtsService::setFormat(GPTAudioFormat format) {
@@ -269,3 +270,4 @@ std::vector<gpt_tts_t> GPTTtsService::getAvailableVoices() {
 
 GPTTtsService aiTts;
 
+#endif // GPT_ENABLE_TTS
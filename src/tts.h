@@ -1,9 +1,17 @@
 #ifndef TTS_SERVICE_H
 #define TTS_SERVICE_H
 
+#include "config.h"
+
+#if !GPT_ENABLE_TTS
+#error "tts.h is included but the service is disabled, see GPT_ENABLE_TTS"
+#endif
+
 #include <Arduino.h>
+#include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <functional>
+#include <string_view>
 #include <vector>
 #include "core.h"
 
@@ -20,7 +28,9 @@ public:
 	// Callback type for TTS responses (audio data)
 	using AudioCallback = std::function<void(const String& text, const uint8_t* audioData, size_t audioSize)>;
 	
-	// Callback type for streaming TTS responses (audio chunks)
+	// Callback type for streaming TTS responses (audio chunks). Chunks arrive
+	// while the shared connection is in use: start other requests from the
+	// last chunk call only, it runs after the connection is released.
 	using StreamCallback = std::function<void(const String& text, const uint8_t* audioChunk, size_t chunkSize, bool isLastChunk)>;
 
 	GPTTtsService();
@@ -41,10 +51,10 @@ public:
 
 	/**
 	 * Convert text to speech
-	 * @param text Text to convert to speech
+	 * @param text Text to convert to speech (literal, view or String; rvalue Strings are moved)
 	 * @param callback Audio data callback
 	 */
-	void textToSpeech(const String& text, AudioCallback callback);
+	void textToSpeech(GPTText text, AudioCallback callback);
 
 	/**
 	 * Convert text to speech with specific voice
@@ -52,14 +62,14 @@ public:
 	 * @param voice Voice to use
 	 * @param callback Audio data callback
 	 */
-	void textToSpeech(const String& text, const String& voice, AudioCallback callback);
+	void textToSpeech(GPTText text, GPTText voice, AudioCallback callback);
 
 	/**
 	 * Convert text to speech with streaming callback
 	 * @param text Text to convert to speech
 	 * @param callback Stream callback for audio chunks
 	 */
-	void textToSpeechStream(const String& text, StreamCallback callback);
+	void textToSpeechStream(GPTText text, StreamCallback callback);
 
 	/**
 	 * Convert text to speech with specific voice and streaming callback
@@ -67,19 +77,19 @@ public:
 	 * @param voice Voice to use
 	 * @param callback Stream callback for audio chunks
 	 */
-	void textToSpeechStream(const String& text, const String& voice, StreamCallback callback);
+	void textToSpeechStream(GPTText text, GPTText voice, StreamCallback callback);
 
 	/**
 	 * Set TTS model
 	 * @param model Model name
 	 */
-	void setModel(const String& model) { _model = model; }
+	void setModel(GPTText model) { _model = model.release(); }
 
 	/**
 	 * Set voice
 	 * @param voice Voice name
 	 */
-	void setVoice(const String& voice) { _voice = voice; }
+	void setVoice(GPTText voice) { _voice = voice.release(); }
 
 	/**
 	 * Set audio format
@@ -106,15 +116,19 @@ private:
 	GPTAudioFormat _format;
 	bool _initialized;
 
+	// Request handed to the HTTP task, owns the payload document and its arena
+	template<typename CallbackType>
+	struct Request;
+
 	// Common HTTP request handler
 	template<typename CallbackType>
-	void performTtsRequest(const String& text, const String& voice, CallbackType callback, bool isStreaming);
+	void performTtsRequest(GPTText text, GPTText voice, CallbackType callback, bool isStreaming);
 
 	// Process API response
 	void processResponse(int httpCode, const String& response, const String& text, AudioCallback callback);
 
 	// Build JSON request payload
-	String buildJsonPayload(const String& text);
+	void buildJsonPayload(JsonDocument& doc, std::string_view text, std::string_view voice);
 };
 
 extern GPTTtsService aiTts;